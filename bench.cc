@@ -0,0 +1,837 @@
+// microbenchmarks for the CPU side of grid.cc, built and run by `make bench`
+//
+// grid.cc is compiled in without its main and every GL entry point it uses
+// is pointed at a stub, so no window or GPU is needed; uploads are counted
+// rather than copied. Results are printed one JSON object per line:
+// {"bench": ..., <parameters>, "ns_per_op": ..., "calls": ..., <counters>}
+
+#define GRID_NO_MAIN
+#include "grid.cc"
+
+#include <initializer_list>
+#include <utility>
+
+// how long each measurement runs, at least
+const double BENCH_SECONDS = 0.2;
+
+typedef std::initializer_list<std::pair<const char *, double>> BenchFields;
+
+// GL stubs
+
+size_t uploadedBytes = 0;
+size_t drawnInstances = 0;
+size_t drawCalls = 0;
+GLint maxTextureBufferTexels = 1 << 30;
+size_t textureBytes = 0;
+unsigned int nextName = 1;
+
+// a no-op with the signature of any GL entry point, returning zero
+template <typename F>
+struct GLStub;
+
+template <typename R, typename... A>
+struct GLStub<R(APIENTRYP)(A...)>
+{
+    static R APIENTRY call(A...)
+    {
+        return R();
+    }
+};
+
+void APIENTRY stubGenNames(GLsizei n, GLuint *names)
+{
+    for (GLsizei i = 0; i < n; i++)
+    {
+        names[i] = nextName++;
+    }
+}
+
+GLuint APIENTRY stubCreateShader(GLenum)
+{
+    return nextName++;
+}
+
+GLuint APIENTRY stubCreateProgram()
+{
+    return nextName++;
+}
+
+void APIENTRY stubBufferData(GLenum, GLsizeiptr size, const void *data, GLenum)
+{
+    if (data)
+    {
+        uploadedBytes += size;
+    }
+}
+
+void APIENTRY stubBufferSubData(GLenum, GLintptr, GLsizeiptr size, const void *)
+{
+    uploadedBytes += size;
+}
+
+void APIENTRY stubDrawElementsInstanced(GLenum, GLsizei, GLenum, const void *, GLsizei instances)
+{
+    drawnInstances += instances;
+    drawCalls++;
+}
+
+void APIENTRY stubTexSubImage2D(GLenum, GLint, GLint, GLint, GLsizei width, GLsizei height, GLenum format, GLenum type, const void *)
+{
+    textureBytes += (size_t)width * height * (format == GL_RGBA ? 4 : 1) * (type == GL_FLOAT ? 4 : type == GL_UNSIGNED_SHORT ? 2 : 1);
+}
+
+GLenum APIENTRY stubCheckFramebufferStatus(GLenum)
+{
+    return GL_FRAMEBUFFER_COMPLETE;
+}
+
+void APIENTRY stubGetIntegerv(GLenum name, GLint *value)
+{
+    if (name == GL_VIEWPORT)
+    {
+        value[0] = value[1] = 0;
+        value[2] = SCR_WIDTH;
+        value[3] = SCR_HEIGHT;
+        return;
+    }
+    *value = name == GL_MAJOR_VERSION || name == GL_MINOR_VERSION ? 3 : name == GL_MAX_TEXTURE_BUFFER_SIZE ? maxTextureBufferTexels
+                                                                                                           : 0;
+}
+
+void APIENTRY stubGetObjectiv(GLuint, GLenum name, GLint *value)
+{
+    *value = name == GL_COMPILE_STATUS || name == GL_LINK_STATUS;
+}
+
+const GLubyte *APIENTRY stubGetString(GLenum)
+{
+    return (const GLubyte *)"stub";
+}
+
+GLuint APIENTRY stubGetUniformBlockIndex(GLuint, const GLchar *)
+{
+    return GL_INVALID_INDEX;
+}
+
+GLint APIENTRY stubGetUniformLocation(GLuint, const GLchar *)
+{
+    return -1;
+}
+
+#define STUB(name) glad_##name = GLStub<decltype(glad_##name)>::call
+
+void stubGL()
+{
+    STUB(glActiveTexture);
+    STUB(glAttachShader);
+    STUB(glBindBuffer);
+    STUB(glBindBufferBase);
+    STUB(glBindFramebuffer);
+    STUB(glBindTexture);
+    STUB(glBindVertexArray);
+    STUB(glBlendFunc);
+    STUB(glClear);
+    STUB(glClearColor);
+    STUB(glCompileShader);
+    STUB(glDeleteProgram);
+    STUB(glDeleteShader);
+    STUB(glDisable);
+    STUB(glDrawArraysInstanced);
+    STUB(glDrawElements);
+    STUB(glEnable);
+    STUB(glEnableVertexAttribArray);
+    STUB(glFramebufferTexture2D);
+    STUB(glGetActiveUniform);
+    STUB(glGetProgramInfoLog);
+    STUB(glGetShaderInfoLog);
+    STUB(glLinkProgram);
+    STUB(glPixelStorei);
+    STUB(glScissor);
+    STUB(glShaderSource);
+    STUB(glTexBuffer);
+    STUB(glTexImage2D);
+    STUB(glTexParameteri);
+    STUB(glUniform1f);
+    STUB(glUniform1i);
+    STUB(glUniform1ui);
+    STUB(glUniform2f);
+    STUB(glUniform4f);
+    STUB(glUniformBlockBinding);
+    STUB(glUseProgram);
+    STUB(glVertexAttribDivisor);
+    STUB(glVertexAttribPointer);
+    STUB(glViewport);
+    glad_glDrawElementsInstanced = stubDrawElementsInstanced;
+    glad_glCheckFramebufferStatus = stubCheckFramebufferStatus;
+    glad_glTexSubImage2D = stubTexSubImage2D;
+    glad_glGenBuffers = stubGenNames;
+    glad_glGenFramebuffers = stubGenNames;
+    glad_glGenTextures = stubGenNames;
+    glad_glGenVertexArrays = stubGenNames;
+    glad_glCreateShader = stubCreateShader;
+    glad_glCreateProgram = stubCreateProgram;
+    glad_glBufferData = stubBufferData;
+    glad_glBufferSubData = stubBufferSubData;
+    glad_glGetIntegerv = stubGetIntegerv;
+    glad_glGetShaderiv = stubGetObjectiv;
+    glad_glGetProgramiv = stubGetObjectiv;
+    glad_glGetString = stubGetString;
+    glad_glGetUniformBlockIndex = stubGetUniformBlockIndex;
+    glad_glGetUniformLocation = stubGetUniformLocation;
+}
+
+// measurement
+
+// call op until BENCH_SECONDS have passed; returns seconds per call
+template <typename Op>
+double measure(Op op, long &calls)
+{
+    op(); // warm up
+    calls = 0;
+    double start = now();
+    double elapsed = 0;
+    for (long batch = 1; elapsed < BENCH_SECONDS; batch *= 2)
+    {
+        for (long i = 0; i < batch; i++)
+        {
+            op();
+        }
+        calls += batch;
+        elapsed = now() - start;
+    }
+    return elapsed / calls;
+}
+
+void report(const char *bench, BenchFields parameters, double seconds, long calls, BenchFields counters = {})
+{
+    cout << "{\"bench\": \"" << bench << "\"";
+    for (auto &field : parameters)
+    {
+        cout << ", \"" << field.first << "\": " << field.second;
+    }
+    cout << ", \"ns_per_op\": " << seconds * 1e9 << ", \"calls\": " << calls;
+    for (auto &field : counters)
+    {
+        cout << ", \"" << field.first << "\": " << field.second;
+    }
+    cout << "}" << endl;
+}
+
+// a deterministic pseudo-random number in [0, 1) for cell (x, y)
+float cellNoise(int x, int y, uint32_t seed = 0)
+{
+    uint32_t h = (x * 73856093u) ^ (y * 19349663u) ^ (seed * 83492791u);
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffffff) / 16777216.0f;
+}
+
+const vec3 palette[] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1), vec3(1, 1, 0)};
+
+// occupancy of the cells shaded, each with one of the first paletteSize colors
+void fillCells(QuadRenderer &cells, float occupancy, int paletteSize)
+{
+    cells.fill([occupancy, paletteSize](int x, int y)
+               {
+                   if (cellNoise(x, y) >= occupancy)
+                   {
+                       return vec3(0);
+                   }
+                   return palette[(int)(cellNoise(x, y, 1) * paletteSize)]; });
+}
+
+// benchmarks
+
+// time to create, fill and pack the first view of a grid of each size, the
+// work main() does before the first frame; the target is 100 ms at 10M cells
+void benchStartup()
+{
+    unsigned int width = GRID_WIDTH, height = GRID_HEIGHT;
+    for (unsigned int size : {1000u, 3163u})
+    {
+        GRID_WIDTH = GRID_HEIGHT = size;
+        double start = now();
+        QuadRenderer *cells = new QuadRenderer();
+        double created = now();
+        cells->fill(vec3(1, 0, 0));
+        double filled = now();
+        cells->bottomLeft = vec2(size / 2 - 50, size / 2 - 50);
+        cells->topRight = cells->bottomLeft + vec2(99, 99);
+        cells->update();
+        double packed = now();
+        report("startup", {{"cells", (double)size * size}}, packed - start, 1,
+               {{"create_ms", (created - start) * 1e3}, {"fill_ms", (filled - created) * 1e3}, {"first_update_ms", (packed - filled) * 1e3},
+                {"threads", std::thread::hardware_concurrency()}});
+        delete cells;
+    }
+    GRID_WIDTH = width;
+    GRID_HEIGHT = height;
+}
+
+void benchFlatten()
+{
+    for (int size : {250, 500, 1000})
+    {
+        vector<vector<mat4>> models(size, vector<mat4>(size, mat4(1.0)));
+        vector<vector<vec3>> colors(size, vector<vec3>(size, vec3(1)));
+        vec2 topRight = vec2(size - 1, size - 1);
+        long calls;
+        double seconds = measure([&]
+                                 { flatten(models, vec2(0), topRight); },
+                                 calls);
+        report("flatten_mat4", {{"grid", size}, {"cells", size * size}}, seconds, calls);
+        seconds = measure([&]
+                          { flatten(colors, vec2(0), topRight); },
+                          calls);
+        report("flatten_vec3", {{"grid", size}, {"cells", size * size}}, seconds, calls);
+    }
+}
+
+void benchUpdate(QuadRenderer &cells)
+{
+    for (int paletteSize : {1, 4})
+    {
+        for (float occupancy : {0.0f, 0.1f, 0.5f, 1.0f})
+        {
+            fillCells(cells, occupancy, paletteSize);
+            for (int view : {100, 1000})
+            {
+                cells.bottomLeft = vec2(0);
+                cells.topRight = vec2(view - 1, view - 1);
+                for (bool merge : {false, true})
+                {
+                    cells.mergeRuns = merge;
+                    long calls;
+                    uploadedBytes = 0;
+                    double seconds = measure([&]
+                                             { cells.update(); },
+                                             calls);
+                    report(merge ? "update_runs" : "update_cells",
+                           {{"view", view}, {"occupancy", occupancy}, {"colors", paletteSize}},
+                           seconds, calls,
+                           {{"instances", cells.shadedRecords.size()}, {"upload_bytes_per_op", (double)uploadedBytes / (calls + 1)}});
+                }
+            }
+        }
+    }
+    cells.mergeRuns = true;
+}
+
+// with the smallest texture buffers GL 3.3 allows, records are split into
+// pages and every record must still be drawn
+bool benchPagedRecords()
+{
+    maxTextureBufferTexels = 65536;
+    QuadRenderer cells;
+    maxTextureBufferTexels = 1 << 30;
+    fillCells(cells, 0.5f, 4);
+    cells.mergeRuns = false;
+    cells.bottomLeft = vec2(0);
+    cells.topRight = vec2(GRID_WIDTH - 1, GRID_HEIGHT - 1);
+    cells.update();
+
+    long calls;
+    drawnInstances = drawCalls = 0;
+    double seconds = measure([&]
+                             { cells.draw(); },
+                             calls);
+    bool complete = drawnInstances == cells.shadedRecords.size() * (calls + 1);
+    report("draw_paged_records", {{"pages", cells.records->pages()}}, seconds, calls,
+           {{"instances_per_frame", (double)drawnInstances / (calls + 1)}, {"draws_per_frame", (double)drawCalls / (calls + 1)}});
+    if (!complete)
+    {
+        cout << "ERROR::BENCH::PAGED_RECORDS_MISSING" << endl;
+    }
+    return complete;
+}
+
+void benchAddCell(Grid &grid)
+{
+    grid.cells.fill(vec3(1, 0, 0));
+    for (int view : {100, 1000})
+    {
+        grid.cells.bottomLeft = vec2(0);
+        grid.cells.topRight = vec2(view - 1, view - 1);
+        grid.cells.update();
+        for (bool updateImmediately : {false, true})
+        {
+            int n = 0;
+            long calls;
+            double seconds = measure([&]
+                                     {
+                                         // alternate colors so every call changes a cell
+                                         int x = n % view, y = n / view % view;
+                                         grid.addCell(vec2(x, y), palette[n / (view * view) % 4 == 0 ? 1 : 2], updateImmediately);
+                                         grid.updates.flush();
+                                         n++; },
+                                     calls);
+            report("add_cell", {{"view", view}, {"update", updateImmediately}}, seconds, calls);
+        }
+    }
+    grid.journal.clear();
+}
+
+// frames with and without the scene cache: one that changes nothing, one
+// that pans by a cell and one that edits a cell, with the cell instances
+// each frame draws
+void benchSceneCache(Grid &grid)
+{
+    fillCells(grid.cells, 0.5f, 4);
+    SceneCache *cache = grid.cache;
+    for (bool cached : {false, true})
+    {
+        grid.cache = cached ? cache : nullptr;
+        grid.cells.viewMargin = cached ? SCENE_CACHE_MARGIN : 0;
+        for (int view : {100, 1000})
+        {
+            int n = 0;
+            auto frame = [&](int kind)
+            {
+                if (kind == 1)
+                {
+                    // a cell to the right and back
+                    grid.cells.bottomLeft = vec2(n % 2, 0);
+                    grid.cells.topRight = grid.cells.bottomLeft + vec2(view - 1, view - 1);
+                    grid.viewChanged();
+                }
+                if (kind == 2)
+                {
+                    grid.addCell(vec2(n % view, 3), palette[n / view % 2]);
+                }
+                grid.updates.flush();
+                grid.draw();
+                n++;
+            };
+            grid.cells.bottomLeft = vec2(0);
+            grid.cells.topRight = vec2(view - 1, view - 1);
+            grid.update();
+            frame(0);
+            const char *names[] = {"frame_static", "frame_pan", "frame_edit"};
+            for (int kind = 0; kind < 3; kind++)
+            {
+                long calls;
+                drawnInstances = 0;
+                double seconds = measure([&]
+                                         { frame(kind); },
+                                         calls);
+                report(names[kind], {{"view", view}, {"cached", cached}}, seconds, calls,
+                       {{"instances_per_frame", (double)drawnInstances / (calls + 1)}});
+            }
+        }
+    }
+
+    // a direct frame between cached ones must not invalidate the cache
+    grid.cache = cache;
+    grid.cells.viewMargin = SCENE_CACHE_MARGIN;
+    grid.draw();
+    long calls;
+    size_t cachedInstances = 0;
+    double seconds = measure([&]
+                             {
+                                 grid.cache = nullptr;
+                                 grid.draw();
+                                 grid.cache = cache;
+                                 size_t before = drawnInstances;
+                                 grid.draw();
+                                 cachedInstances += drawnInstances - before; },
+                             calls);
+    report("frame_switch_paths", {}, seconds, calls,
+           {{"cached_instances_per_frame", (double)cachedInstances / (calls + 1)}});
+    grid.journal.clear();
+}
+
+// the heatmap layer: texture bytes uploaded to set scattered cells or all of
+// them, and the cost of rescaling, which should upload nothing
+void benchScalars(Grid &grid)
+{
+    for (ScalarFormat format : {SCALAR_FLOAT, SCALAR_UINT16})
+    {
+        grid.enableScalars(format);
+        grid.draw();
+        for (int cells : {1, 100, 10000})
+        {
+            int n = 0;
+            long calls;
+            textureBytes = 0;
+            double seconds = measure([&]
+                                     {
+                                         for (int i = 0; i < cells; i++, n++)
+                                         {
+                                             grid.setScalar(vec2(cellNoise(n, 0) * GRID_WIDTH, cellNoise(n, 1) * GRID_HEIGHT), n % 1000);
+                                         }
+                                         grid.draw(); },
+                                     calls);
+            report("set_scalars", {{"uint16", format == SCALAR_UINT16}, {"cells", cells}}, seconds, calls,
+                   {{"upload_bytes_per_cell", (double)textureBytes / ((calls + 1.0) * cells)}});
+        }
+
+        long calls;
+        textureBytes = 0;
+        double seconds = measure([&]
+                                 {
+                                     grid.scalars->fill([](int x, int y)
+                                                        { return (float)((x + y) % 1000); });
+                                     grid.draw(); },
+                                 calls);
+        report("fill_scalars", {{"uint16", format == SCALAR_UINT16}, {"cells", GRID_WIDTH * GRID_HEIGHT}}, seconds, calls,
+               {{"upload_bytes_per_cell", (double)textureBytes / ((calls + 1.0) * GRID_WIDTH * GRID_HEIGHT)}});
+
+        textureBytes = 0;
+        float top = 1000;
+        seconds = measure([&]
+                                 {
+                                     grid.scalars->setRange(0, top = top == 1000 ? 500 : 1000);
+                                     grid.draw(); },
+                                 calls);
+        report("rescale_scalars", {{"uint16", format == SCALAR_UINT16}}, seconds, calls,
+               {{"upload_bytes_per_op", (double)textureBytes / (calls + 1)}});
+    }
+    delete grid.scalars;
+    grid.scalars = nullptr;
+}
+
+// animated states should cost no uploads however many cells animate
+void benchStates(Grid &grid)
+{
+    grid.enableStates();
+    grid.states->setStyle(1, StateStyle{vec4(1, 0, 0, 1), vec4(1, 1, 0, 1), STATE_BLINK, 1.0f});
+    grid.states->setStyle(2, StateStyle{vec4(1, 0.5f, 0, 1), vec4(0), STATE_PULSE, 2.0f});
+    int n = 0;
+    for (int cells : {100, 10000, 1000000})
+    {
+        for (; n < cells; n++)
+        {
+            grid.setState(vec2(cellNoise(n, 0) * GRID_WIDTH, cellNoise(n, 1) * GRID_HEIGHT), 1 + n % 2);
+        }
+        grid.draw();
+
+        long calls;
+        textureBytes = 0;
+        double seconds = measure([&]
+                                 { grid.draw(); },
+                                 calls);
+        report("animate_states", {{"cells", cells}}, seconds, calls,
+               {{"upload_bytes_per_frame", (double)textureBytes / (calls + 1)}});
+    }
+
+    // restyling a state touches its palette entry, not its cells
+    long calls;
+    textureBytes = 0;
+    int period = 1;
+    double seconds = measure([&]
+                             {
+                                 grid.states->setStyle(1, StateStyle{vec4(1, 0, 0, 1), vec4(1, 1, 0, 1), STATE_BLINK, (float)(period = 3 - period)});
+                                 grid.draw(); },
+                             calls);
+    report("restyle_states", {}, seconds, calls,
+           {{"upload_bytes_per_op", (double)textureBytes / (calls + 1)}});
+    delete grid.states;
+    grid.states = nullptr;
+}
+
+// a new query should move no cell data and redraw nothing beneath it
+void benchQueries(Grid &grid)
+{
+    grid.enableScalars(SCALAR_FLOAT);
+    grid.scalars->fill([](int x, int y)
+                       { return (float)((x + y) % 1000); });
+    grid.enableStates();
+    for (int n = 0; n < 10000; n++)
+    {
+        grid.setState(vec2(cellNoise(n, 0) * GRID_WIDTH, cellNoise(n, 1) * GRID_HEIGHT), 1 << (n % 8));
+    }
+    grid.draw();
+
+    CellQuery above, flagged;
+    above.testValue = true;
+    above.valueMax = INFINITY;
+    flagged.testBits = true;
+    flagged.bits = 1;
+    for (CellQuery *q : {&above, &flagged})
+    {
+        long calls;
+        int n = 0;
+        uploadedBytes = textureBytes = drawnInstances = 0;
+        double seconds = measure([&]
+                                 {
+                                     q->valueMin = n % 1000;
+                                     q->mask = 1 | (1 << (n % 8));
+                                     grid.setQuery(*q, n++ % 2 ? QUERY_HIGHLIGHT : QUERY_DIM, vec4(1, 1, 1, 0.5f));
+                                     grid.draw(); },
+                                 calls);
+        report("set_query", {{"state_bits", q == &flagged}}, seconds, calls,
+               {{"upload_bytes_per_op", (double)(uploadedBytes + textureBytes) / (calls + 1)},
+                {"instances_per_frame", (double)drawnInstances / (calls + 1)}});
+    }
+    grid.clearQuery();
+    delete grid.states;
+    grid.states = nullptr;
+    delete grid.scalars;
+    grid.scalars = nullptr;
+}
+
+// an edit to a tile that is never loaded must still reach the file
+bool benchTileEdits()
+{
+    char path[] = "/tmp/grid-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return false;
+    }
+    close(fd);
+    unlink(path);
+
+    TileStore store;
+    store.open(path, TILE_SIZE * 4, TILE_SIZE * 4);
+    int n = 0;
+    long calls;
+    TileCache *cache = new TileCache(store);
+    double seconds = measure([&]
+                             {
+                                 cache->setCell((n * 7) % store.width, (n * 13) % store.height, vec3(0, 0, 1));
+                                 n++; },
+                             calls);
+    cache->setCell(TILE_SIZE * 3 + 1, TILE_SIZE * 2 + 5, vec3(0.25f, 0.5f, 1));
+    delete cache;
+
+    vector<vec3> colors(TileStore::tileCells);
+    store.readTile(store.tileId(3, 2), colors.data());
+    unlink(path);
+    bool kept = colors[1 * TILE_SIZE + 5] == vec3(0.25f, 0.5f, 1);
+    report("offscreen_tile_edit", {}, seconds, calls, {{"kept", kept}});
+    if (!kept)
+    {
+        cout << "ERROR::BENCH::TILE_EDIT_LOST" << endl;
+    }
+    return kept;
+}
+
+void benchRayCast()
+{
+    cameraPos = vec3(GRID_WIDTH / 2, GRID_HEIGHT / 2, 15.0f);
+    projection = perspective(radians(fov), ar, nearDist, farDist);
+    view = lookAt(cameraPos, cameraPos + cameraFront, vec3(0, 1, 0));
+
+    volatile float sink = 0;
+    int n = 0;
+    long calls;
+    double seconds = measure([&]
+                             {
+                                 vec3 ray = rayCast(n % SCR_WIDTH, n % SCR_HEIGHT, projection, view);
+                                 sink = ray.x;
+                                 n++; },
+                             calls);
+    report("ray_cast", {}, seconds, calls);
+
+    vec3 ray = rayCast(SCR_WIDTH / 2, SCR_HEIGHT / 2, projection, view);
+    seconds = measure([&]
+                      {
+                          vec3 hit = rayPlaneIntersection(cameraPos, ray, vec3(0, 0, 1), vec3(0, 0, n++ % 2));
+                          sink = hit.x; },
+                      calls);
+    report("ray_plane_intersection", {}, seconds, calls);
+}
+
+// every kernel the CPU supports on one tile's worth of cells; the positions
+// found must match the scalar kernel's, or make bench fails
+bool benchSimd()
+{
+    size_t count = TileStore::tileCells;
+    vector<vec3> colors(count);
+    vector<uint64_t> bits((count + 63) / 64);
+    vector<uint32_t> indices(count + COMPACT_SLACK), expected(count + COMPACT_SLACK);
+    vector<SimdKernels> kernels = supportedKernels();
+    bool passed = true;
+    for (float occupancy : {0.0f, 0.1f, 0.5f, 1.0f})
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            colors[i] = cellNoise(i, 0) < occupancy ? palette[i % 4] : vec3(0);
+        }
+        occupancyScalar(colors.data(), count, bits.data());
+        size_t n = compactScalar(bits.data(), count, expected.data());
+        for (size_t k = 0; k < kernels.size(); k++)
+        {
+            const SimdKernels &kernel = kernels[k];
+            kernel.occupancy(colors.data(), count, bits.data());
+            bool matches = kernel.compact(bits.data(), count, indices.data()) == n && std::equal(expected.begin(), expected.begin() + n, indices.begin());
+            if (!matches)
+            {
+                cout << "ERROR::BENCH::SIMD_MISMATCH\n"
+                     << kernel.name << " at occupancy " << occupancy << endl;
+                passed = false;
+            }
+
+            long calls;
+            double seconds = measure([&]
+                                     { kernel.occupancy(colors.data(), count, bits.data()); },
+                                     calls);
+            report("occupancy", {{"kernel", k}, {"cells", count}, {"occupancy", occupancy}}, seconds, calls,
+                   {{"chosen", kernel.name == simd.name}, {"matches_scalar", matches}});
+            seconds = measure([&]
+                              { kernel.compact(bits.data(), count, indices.data()); },
+                              calls);
+            report("compact", {{"kernel", k}, {"cells", count}, {"occupancy", occupancy}}, seconds, calls,
+                   {{"chosen", kernel.name == simd.name}, {"matches_scalar", matches}});
+        }
+    }
+    return passed;
+}
+
+void benchAddLine(LineRenderer &lines)
+{
+    for (int count : {1000, 10000, 100000})
+    {
+        vector<LineInstance> batch;
+        for (int i = 0; i < count; i++)
+        {
+            batch.push_back(LineInstance{vec3(i, 0, 0), vec3(i, 1000, 0), GRID_LINE_WIDTH, GRID_LINE_COLOR});
+        }
+        for (bool batched : {false, true})
+        {
+            long calls;
+            uploadedBytes = 0;
+            double seconds = measure([&]
+                                     {
+                                         lines.clearLines();
+                                         if (batched)
+                                         {
+                                             lines.addLines(batch);
+                                             return;
+                                         }
+                                         for (const LineInstance &line : batch)
+                                         {
+                                             lines.addLine(line.start, line.end, line.width, line.color);
+                                         } },
+                                     calls);
+            report(batched ? "add_lines" : "add_line", {{"lines", count}}, seconds, calls,
+                   {{"ns_per_line", seconds * 1e9 / count}, {"upload_bytes_per_op", (double)uploadedBytes / (calls + 1)}});
+        }
+        lines.clearLines();
+    }
+}
+
+// the counter must see every form of operator new, or an over-aligned or
+// nothrow allocation in a frame would go unnoticed
+bool benchAllocationForms()
+{
+    struct alignas(64) Aligned
+    {
+        char bytes[64];
+    };
+    // kept in volatile pointers so that the compiler cannot elide them
+    size_t count = allocations;
+    Aligned *volatile aligned = new Aligned;
+    Aligned *volatile alignedArray = new Aligned[2];
+    int *volatile nothrow = new (std::nothrow) int;
+    Aligned *volatile nothrowAligned = new (std::nothrow) Aligned;
+    int *volatile nothrowArray = new (std::nothrow) int[2];
+    delete aligned;
+    delete[] alignedArray;
+    delete nothrow;
+    delete nothrowAligned;
+    delete[] nothrowArray;
+    count = allocations - count;
+    if (count != 5)
+    {
+        cout << "ERROR::BENCH::ALLOCATIONS_UNCOUNTED\n"
+             << count << " of 5 allocations counted" << endl;
+        return false;
+    }
+    return true;
+}
+
+// frames that neither load nor expand rows must not touch the heap once
+// their buffers have grown: run each case until it settles, then count.
+// Returns false, failing make bench, if any case still allocates.
+bool benchAllocations(Grid &grid)
+{
+    const int warmup = 64, frames = 64;
+    fillCells(grid.cells, 0.5f, 4);
+    grid.cells.bottomLeft = vec2(0);
+    grid.cells.topRight = vec2(299, 299);
+    grid.cells.update();
+
+    int n = 0;
+    std::pair<const char *, std::function<void()>> cases[] = {
+        {"steady_unchanged", [&]
+         {
+             grid.update();
+             grid.updates.flush();
+             grid.draw();
+         }},
+        {"steady_edit", [&]
+         {
+             grid.cells.addQuad(vec2(n % 8, 7), palette[n / 8 % 2]);
+             grid.update();
+             grid.updates.flush();
+             grid.draw();
+         }},
+        {"steady_pan", [&]
+         {
+             grid.cells.bottomLeft = vec2(n % 4 * 10, 0);
+             grid.cells.topRight = grid.cells.bottomLeft + vec2(299, 299);
+             grid.update();
+             grid.updates.flush();
+             grid.draw();
+         }},
+    };
+
+    bool passed = true;
+    for (bool merge : {true, false})
+    {
+        grid.cells.mergeRuns = merge;
+        for (auto &test : cases)
+        {
+            for (int i = 0; i < warmup; i++, n++)
+            {
+                test.second();
+            }
+            size_t count = allocations, bytes = allocatedBytes;
+            double start = now();
+            for (int i = 0; i < frames; i++, n++)
+            {
+                test.second();
+            }
+            double seconds = (now() - start) / frames;
+            count = allocations - count;
+            bytes = allocatedBytes - bytes;
+            report(test.first, {{"merge", merge}}, seconds, frames,
+                   {{"allocations_per_frame", (double)count / frames}, {"bytes_per_frame", (double)bytes / frames}});
+            if (count > 0)
+            {
+                cout << "ERROR::BENCH::STEADY_STATE_ALLOCATES\n"
+                     << test.first << (merge ? " (runs): " : " (per cell): ") << count << " allocations in " << frames << " frames" << endl;
+                passed = false;
+            }
+        }
+    }
+    grid.cells.mergeRuns = true;
+    return passed;
+}
+
+int main()
+{
+    stubGL();
+
+    grid = new Grid();
+    bool passed = benchAllocationForms();
+    passed = benchAllocations(*grid) && passed;
+    benchStartup();
+    benchFlatten();
+    benchUpdate(grid->cells);
+    passed = benchPagedRecords() && passed;
+    benchAddCell(*grid);
+    benchSceneCache(*grid);
+    benchScalars(*grid);
+    benchStates(*grid);
+    benchQueries(*grid);
+    passed = benchTileEdits() && passed;
+    benchRayCast();
+    passed = benchSimd() && passed;
+    benchAddLine(grid->lines);
+    delete grid;
+    return passed ? 0 : 1;
+}
@@ -1,6 +1,34 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <string>
+#include <iterator>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
@@ -11,6 +39,7 @@
 
 using glm::mat4;
 using glm::normalize;
+using glm::ortho;
 using glm::perspective;
 using glm::radians;
 using glm::vec2;
@@ -24,19 +53,56 @@ void processInput(GLFWwindow *window);
 void mouse_callback(GLFWwindow *window, double xpos, double ypos);
 void mouse_button_callback(GLFWwindow *window, int button, int action, int mods);
 void scroll_callback(GLFWwindow *window, double xoffset, double yoffset);
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
+void refresh_callback(GLFWwindow *window);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 
-// grid dimensions
-const unsigned int GRID_WIDTH = 1000;
-const unsigned int GRID_HEIGHT = 1000;
+// grid dimensions; grid --size sets them before anything is created
+unsigned int GRID_WIDTH = 1000;
+unsigned int GRID_HEIGHT = 1000;
+
+// grid lines
+const float GRID_LINE_WIDTH = 1.0f; // pixels
+const vec4 GRID_LINE_COLOR = vec4(0, 0, 0, 1);
+const int GRID_MAJOR_LINES = 10;           // a major line every this many cells
+const float GRID_MINOR_LINE_WIDTH = 1.0f;  // pixels; major lines use GRID_LINE_*
+const vec4 GRID_MINOR_LINE_COLOR = vec4(0, 0, 0, 0.35f);
+const float GRID_LINE_MIN_SPACING = 6.0f;  // pixels; closer lines are dropped
+
+// tiled streaming (grid --tiles FILE): cells are loaded in square tiles
+const unsigned int TILE_SIZE = 64;
+const unsigned int TILE_IO_THREADS = 2;
+const unsigned int TILE_WRITE_ATTEMPTS = 3; // then the tile is kept in memory
+const unsigned int MAX_RESIDENT_TILES = 2048; // CPU cache, 48KB per tile
+const unsigned int MAX_GPU_TILES = 512;       // GPU slots, 304KB per tile
+const unsigned int MAX_TILE_UPLOADS = 32;     // per frame, to keep panning smooth
+const vec3 TILE_PLACEHOLDER_COLOR = vec3(0.85f);
+
+// rows of the in-memory grid that are neither visible nor edited for this
+// long are run-length compressed, a few rows per frame
+const double COLD_ROW_SECONDS = 5.0;
+const unsigned int COLD_ROWS_PER_FRAME = 16;
+
+// in-memory grids are drawn from a cached image of the scene that covers the
+// view plus this fraction of its size on every side; it is re-rendered when
+// the view leaves it or is zoomed by more than SCENE_CACHE_MAX_ZOOM
+const float SCENE_CACHE_MARGIN = 0.5f;
+const float SCENE_CACHE_MAX_ZOOM = 1.5f;
+
+// undo history is dropped oldest first beyond this many bytes
+const size_t JOURNAL_BYTES = 64 << 20;
+
+// updates too slow for a frame are deferred until the view has been still
+// this long, and amortized over at most this many frames when they are not
+const double UPDATE_SETTLE_SECONDS = 0.15;
+const int UPDATE_MAX_FRAMES = 8;
 
 float lastX = SCR_WIDTH / 2.0f;
 float lastY = SCR_HEIGHT / 2.0f;
 bool firstMouse = true;
-bool realTimeUpdating = true;
 
 // timing
 float deltaTime = 0.0f;
@@ -56,489 +122,4482 @@ float nearDist = 0.1f;
 float farDist = 1000.0f;
 float ar = (float)SCR_WIDTH / (float)SCR_HEIGHT;
 
-class LineRenderer
-{
-    int shaderProgram;
-    unsigned int VBO, VAO;
-    mat4 viewProjection;
+// F5 saves the grid here and F9 loads it back
+const char *snapshotPath = "grid.snapshot";
 
-    vector<float> vertices;
+// the color of empty (never set or erased) cells, which are not drawn at all
+vec3 backgroundColor = vec3(1.0f);
 
-public:
-    LineRenderer()
-    {
+// grid --no-scene-cache draws the cells and lines every frame instead
+bool useSceneCache = true;
 
-        const char *vertexShaderSource = "#version 330 core\n"
-                                         "layout (location = 0) in vec3 aPos;\n"
-                                         "uniform mat4 viewProjection;\n"
-                                         "void main()\n"
-                                         "{\n"
-                                         "   gl_Position = viewProjection * vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
-                                         "}\0";
-        const char *fragmentShaderSource = "#version 330 core\n"
-                                           "out vec4 FragColor;\n"
-                                           "void main()\n"
-                                           "{\n"
-                                           "   FragColor = vec4(0,0,0,1);\n"
-                                           "}\n\0";
+// seconds a frame may take; cell updates get what drawing leaves of it
+double frameBudget = 0.016;
 
-        // vertex shader
-        int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-        glCompileShader(vertexShader);
-        // check for shader compile errors
-        int success;
-        char infoLog[512];
-        glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-        if (!success)
-        {
-            glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-            cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n"
-                 << infoLog << endl;
-        }
-        // fragment shader
-        int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-        glCompileShader(fragmentShader);
-        // check for shader compile errors
-        glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-        if (!success)
-        {
-            glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-            cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n"
-                 << infoLog << endl;
-        }
-        // link shaders
-        shaderProgram = glCreateProgram();
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
-        glLinkProgram(shaderProgram);
-        // check for linking errors
-        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-        if (!success)
-        {
-            glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-            cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
-                 << infoLog << endl;
-        }
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
+// grid --on-demand draws a frame only after something on screen changed and
+// otherwise sleeps in glfwWaitEvents; whatever changes the picture, on any
+// thread, calls requestRedraw(). Idle, it still wakes this often to compress
+// cold rows.
+bool onDemand = false;
+std::atomic<bool> redrawRequested{true};
+const double ON_DEMAND_IDLE_SECONDS = 1.0;
 
-        vector<float> placeHolderVertices = {};
+void requestRedraw()
+{
+    redrawRequested = true;
+    if (onDemand)
+    {
+        glfwPostEmptyEvent();
+    }
+}
 
-        vertices.insert(vertices.end(), placeHolderVertices.begin(), placeHolderVertices.end());
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glBindVertexArray(VAO);
+// GL_ARB_get_program_binary (core in 4.1) is not in our 3.3 glad loader, so
+// the entry points are looked up by hand
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+typedef void(APIENTRYP GetProgramBinaryProc)(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+typedef void(APIENTRYP ProgramBinaryProc)(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+typedef void(APIENTRYP ProgramParameteriProc)(GLuint program, GLenum pname, GLint value);
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+// the camera lives in one uniform buffer shared by every program, bound
+// once at CAMERA_BINDING; shaders declare it by including CAMERA_BLOCK
+const unsigned int CAMERA_BINDING = 0;
+#define CAMERA_BLOCK "layout (std140) uniform Camera\n"     \
+                     "{\n"                                   \
+                     "    mat4 viewProjection;\n"            \
+                     "    vec4 cameraPosition;\n"            \
+                     "    vec4 viewport; // width, height\n" \
+                     "};\n"
 
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-        glEnableVertexAttribArray(0);
+struct CameraBlock
+{
+    mat4 viewProjection;
+    vec4 cameraPosition;
+    vec4 viewport;
+};
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
-    }
+// a linked program and the locations of its uniforms, resolved once it is linked
+class ShaderProgram
+{
+    std::unordered_map<std::string, int> locations;
 
-    void setCamera(mat4 cameraMatrix)
-    {
-        viewProjection = cameraMatrix;
-    }
+public:
+    unsigned int id = 0;
 
-    void addLine(vec3 start, vec3 end)
+    void resolve()
     {
-        vector<float> lineVertices = {
-            start.x,
-            start.y,
-            start.z,
-            end.x,
-            end.y,
-            end.z,
-
-        };
+        unsigned int block = glGetUniformBlockIndex(id, "Camera");
+        if (block != GL_INVALID_INDEX)
+        {
+            glUniformBlockBinding(id, block, CAMERA_BINDING);
+        }
 
-        vertices.insert(vertices.end(), lineVertices.begin(), lineVertices.end());
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+        int count = 0;
+        glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+        for (int i = 0; i < count; i++)
+        {
+            char name[256];
+            int size;
+            GLenum type;
+            glGetActiveUniform(id, i, sizeof(name), NULL, &size, &type, name);
+            int location = glGetUniformLocation(id, name);
+            // block members have no location of their own
+            if (location >= 0)
+            {
+                // arrays are reported as "name[0]"
+                char *bracket = strchr(name, '[');
+                if (bracket)
+                {
+                    *bracket = 0;
+                }
+                locations[name] = location;
+            }
+        }
     }
 
-    int draw()
+    int uniform(const char *name)
     {
-        glUseProgram(shaderProgram);
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "viewProjection"), 1, GL_FALSE, &viewProjection[0][0]);
-
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_LINES, 0, vertices.size() / 3);
-        return 0;
+        auto it = locations.find(name);
+        return it == locations.end() ? -1 : it->second;
     }
 };
 
-// maths functions to pick which grid (not necessary, just for demonstration purposes)
-
-vec3 rayCast(double xpos, double ypos, mat4 projection, mat4 view)
-{
-    // converts a position from the 2d xpos, ypos to a normalized 3d direction
-    float x = (2.0f * xpos) / SCR_WIDTH - 1.0f;
-    float y = 1.0f - (2.0f * ypos) / SCR_HEIGHT;
-    float z = 1.0f;
-    vec3 ray_nds = vec3(x, y, z);
-    vec4 ray_clip = vec4(ray_nds.x, ray_nds.y, -1.0f, 1.0f);
-    // eye space to clip we would multiply by projection so
-    // clip space to eye space is the inverse projection
-    vec4 ray_eye = inverse(projection) * ray_clip;
-    // convert point to forwards
-    ray_eye = vec4(ray_eye.x, ray_eye.y, -1.0f, 0.0f);
-    // world space to eye space is usually multiply by view so
-    // eye space to world space is inverse view
-    vec4 inv_ray_wor = (inverse(view) * ray_eye);
-    vec3 ray_wor = vec3(inv_ray_wor.x, inv_ray_wor.y, inv_ray_wor.z);
-    ray_wor = normalize(ray_wor);
-    return ray_wor;
-}
-
-vec3 rayPlaneIntersection(vec3 ray_position, vec3 ray_direction, vec3 plane_normal, vec3 plane_position)
-{
-    float d = dot(plane_normal, plane_position - ray_position) / (0.001 + dot(ray_direction, plane_normal));
-    return ray_position + ray_direction * d;
-}
-
-template <typename T>
-vector<T> flatten(const vector<vector<T>> &orig, vec2 bottomLeft = vec2(0, 0), vec2 topRight = vec2(GRID_WIDTH, GRID_HEIGHT))
+// the uniform buffer behind CAMERA_BLOCK, written once per camera change
+class CameraUniforms
 {
-    vector<T> ret;
-    // for(const auto &v: orig)
-    //     ret.insert(ret.end(), v.begin(), v.end());
-    float rx = (topRight.x >= GRID_WIDTH ? GRID_WIDTH : topRight.x + 1);
-    float ry = (topRight.y >= GRID_HEIGHT ? GRID_HEIGHT : topRight.y + 1);
+    unsigned int UBO;
 
-    float lx = (bottomLeft.x <= 0 ? 0 : bottomLeft.x);
-    float ly = (bottomLeft.y <= 0 ? 0 : bottomLeft.y);
+public:
+    CameraUniforms()
+    {
+        glGenBuffers(1, &UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
 
-    for (int i = lx; i < rx; i++)
+    void set(mat4 viewProjection, vec2 viewport = vec2(SCR_WIDTH, SCR_HEIGHT))
     {
-        vector<T> v = orig[i];
-        ret.insert(ret.end(), v.begin() + ly, v.begin() + ry);
+        CameraBlock block;
+        block.viewProjection = viewProjection;
+        block.cameraPosition = vec4(cameraPos, 1.0);
+        block.viewport = vec4(viewport.x, viewport.y, 0.0, 0.0);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
     }
-    return ret;
-}
+};
 
-class QuadRenderer
+// builds every shader program at most once per process. Linked binaries are
+// kept in ~/.cache/glgrid, keyed by a hash of the driver and the sources, so
+// that later launches on the same driver skip compiling altogether.
+class ShaderCache
 {
+    std::unordered_map<uint64_t, ShaderProgram> programs;
 
-public:
-    unsigned int shaderProgram;
-    unsigned int VBO, VAO, EBO;
+    bool binariesSupported = false;
+    GetProgramBinaryProc getProgramBinary = nullptr;
+    ProgramBinaryProc programBinary = nullptr;
+    ProgramParameteriProc programParameteri = nullptr;
+    std::string directory;
+    std::string driver;
 
-    unsigned int matrixBuffer;
-    unsigned int colorBuffer;
+    static uint64_t hash(const std::string &text, uint64_t h = 14695981039346656037ull)
+    {
+        // FNV-1a
+        for (unsigned char c : text)
+        {
+            h = (h ^ c) * 1099511628211ull;
+        }
+        return h;
+    }
 
-    vector<vector<vec3>> colors;
-    vector<vector<vec3>> frustumCulledColors;
-    vector<vec3> _colors;
+    std::string binaryPath(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+        return directory + name;
+    }
 
-    vector<vector<mat4>> models;
-    vector<vector<mat4>> frustumCulledModels;
-    vector<mat4> _models;
+    void init()
+    {
+        const char *version = (const char *)glGetString(GL_VERSION);
+        driver = std::string((const char *)glGetString(GL_VENDOR)) + "\n" + (const char *)glGetString(GL_RENDERER) + "\n" + version;
 
-    mat4 viewProjection;
+        int major = 0, minor = 0, formats = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major > 4 || (major == 4 && minor >= 1) || glfwExtensionSupported("GL_ARB_get_program_binary"))
+        {
+            getProgramBinary = (GetProgramBinaryProc)glfwGetProcAddress("glGetProgramBinary");
+            programBinary = (ProgramBinaryProc)glfwGetProcAddress("glProgramBinary");
+            programParameteri = (ProgramParameteriProc)glfwGetProcAddress("glProgramParameteri");
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        }
+        binariesSupported = getProgramBinary && programBinary && programParameteri && formats > 0;
 
-    vec2 bottomLeft = vec2(0, 0);
-    vec2 topRight = vec2(GRID_WIDTH, GRID_HEIGHT);
+        const char *cacheHome = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        if (cacheHome && *cacheHome)
+        {
+            directory = std::string(cacheHome) + "/glgrid";
+        }
+        else if (home && *home)
+        {
+            mkdir((std::string(home) + "/.cache").c_str(), 0755);
+            directory = std::string(home) + "/.cache/glgrid";
+        }
+        else
+        {
+            binariesSupported = false;
+        }
+        if (binariesSupported)
+        {
+            mkdir(directory.c_str(), 0755);
+        }
+    }
 
-    QuadRenderer()
+    bool loadBinary(unsigned int program, uint64_t key)
     {
-
-        // create an empty grid
-        colors.resize(GRID_WIDTH);
-        for (int j = 0; j < GRID_WIDTH; j++)
+        std::ifstream file(binaryPath(key), std::ios::binary);
+        GLenum format;
+        if (!file.read((char *)&format, sizeof(format)))
         {
-            colors[j].resize(GRID_HEIGHT);
-            std::fill(colors[j].begin(), colors[j].end(), vec3(0));
+            return false;
         }
+        vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        programBinary(program, format, binary.data(), binary.size());
+
+        // fails when the driver no longer accepts the binary, e.g. after an update
+        int success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        return success;
+    }
 
-        models.resize(GRID_WIDTH);
-        for (int j = 0; j < GRID_WIDTH; j++)
+    void saveBinary(unsigned int program, uint64_t key)
+    {
+        int length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
         {
-            models[j].resize(GRID_HEIGHT);
-            std::fill(models[j].begin(), models[j].end(), mat4(0));
+            return;
         }
+        vector<char> binary(length);
+        GLenum format;
+        getProgramBinary(program, length, NULL, &format, binary.data());
 
-        const char *vertexShaderSource = "#version 330 core\n"
-                                         "layout (location = 0) in vec3 aPos;\n"
-                                         "layout (location = 1) in mat4 aInstanceMatrix;\n"
-                                         "layout (location = 5) in vec3 aCol\n;"
-                                         "uniform mat4 viewProjection;\n"
-                                         "out vec3 color;\n"
-                                         "void main()\n"
-                                         "{\n"
-                                         "   gl_Position = viewProjection * aInstanceMatrix * vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
-                                         "   color = aCol;\n"
-                                         "}\0";
-        const char *fragmentShaderSource = "#version 330 core\n"
-                                           "out vec4 FragColor;\n"
-                                           "in vec3 color;\n"
-                                           "void main()\n"
-                                           "{\n"
-                                           "   FragColor = vec4(color,1);\n"
-                                           "}\n\0";
+        // write to a temporary file first so another instance never reads half a binary
+        std::string path = binaryPath(key);
+        std::string temporary = path + "." + std::to_string(getpid());
+        std::ofstream file(temporary, std::ios::binary);
+        file.write((const char *)&format, sizeof(format));
+        file.write(binary.data(), binary.size());
+        file.close();
+        if (!file || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+        }
+    }
 
-        // build and compile our shader program
-        // ------------------------------------
-        // vertex shader
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-        glCompileShader(vertexShader);
+    static unsigned int compile(GLenum type, const char *source, const char *stage)
+    {
+        unsigned int shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
         // check for shader compile errors
         int success;
         char infoLog[512];
-        glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
         if (!success)
         {
-            glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-            cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n"
+            glGetShaderInfoLog(shader, 512, NULL, infoLog);
+            cout << "ERROR::SHADER::" << stage << "::COMPILATION_FAILED\n"
                  << infoLog << endl;
         }
-        // fragment shader
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-        glCompileShader(fragmentShader);
-        // check for shader compile errors
-        glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-        if (!success)
+        return shader;
+    }
+
+    unsigned int link(const char *vertexShaderSource, const char *fragmentShaderSource)
+    {
+        unsigned int vertexShader = compile(GL_VERTEX_SHADER, vertexShaderSource, "VERTEX");
+        unsigned int fragmentShader = compile(GL_FRAGMENT_SHADER, fragmentShaderSource, "FRAGMENT");
+
+        unsigned int program = glCreateProgram();
+        if (binariesSupported)
         {
-            glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-            cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n"
-                 << infoLog << endl;
+            programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         }
-        // link shaders
-        shaderProgram = glCreateProgram();
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
-        glLinkProgram(shaderProgram);
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glLinkProgram(program);
         // check for linking errors
-        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+        int success;
+        char infoLog[512];
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
         if (!success)
         {
-            glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
+            glGetProgramInfoLog(program, 512, NULL, infoLog);
             cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
                  << infoLog << endl;
         }
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
+        return program;
+    }
 
-        float vertices[] = {
-            1.0f, 1.0f, 0.0f, // top right
-            1.0f, 0.0f, 0.0f, // bottom right
-            0.0f, 0.0f, 0.0f, // bottom left
-            0.0f, 1.0f, 0.0f  // top left
-        };
+public:
+    // the program for this pair of sources, built on first use
+    ShaderProgram &get(const char *vertexShaderSource, const char *fragmentShaderSource)
+    {
+        if (driver.empty())
+        {
+            init();
+        }
 
-        unsigned int indices[] = {
-            // note that we start from 0!
-            0, 1, 3, // first Triangle
-            1, 2, 3  // second Triangle
-        };
+        uint64_t key = hash(fragmentShaderSource, hash(vertexShaderSource, hash(driver)));
+        auto it = programs.find(key);
+        if (it != programs.end())
+        {
+            return it->second;
+        }
 
-        _models = flatten(models);
-        _colors = flatten(colors);
+        ShaderProgram &shader = programs[key];
+        if (binariesSupported)
+        {
+            shader.id = glCreateProgram();
+            if (loadBinary(shader.id, key))
+            {
+                shader.resolve();
+                return shader;
+            }
+            glDeleteProgram(shader.id);
+        }
 
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
-        glGenBuffers(1, &EBO);
-        glGenBuffers(1, &matrixBuffer);
-        glGenBuffers(1, &colorBuffer);
+        shader.id = link(vertexShaderSource, fragmentShaderSource);
+        shader.resolve();
+        if (binariesSupported)
+        {
+            saveBinary(shader.id, key);
+        }
+        return shader;
+    }
+};
 
-        // bind the Vertex Array Object first, then bind and set vertex buffer(s), and then configure vertex attributes(s).
-        glBindVertexArray(VAO);
+ShaderCache shaders;
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+// one segment of a LineRenderer
+struct LineInstance
+{
+    vec3 start;
+    vec3 end;
+    float width; // pixels
+    vec4 color;
+};
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+// the lattice lines generated for one view. Everything that draws the
+// lattice keeps its own, so the scene cache and the live view never
+// regenerate each other's lines
+struct LatticeView
+{
+    unsigned int VAO = 0;
+    unsigned int buffer = 0;
+    vector<LineInstance> instances;
+    int bounds[5] = {0, 0, 0, 0, 0}; // x0, y0, x1, y1, step
+    unsigned int lattice = 0;        // LineRenderer::lattice when generated
+};
 
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-        glEnableVertexAttribArray(0);
+// draws each line as an instance of a quad that the vertex shader stretches
+// between the two end points and widens to width pixels on screen; the
+// fragment shader fades the outermost pixel for anti-aliasing. This avoids
+// GL_LINES, whose width core profile drivers are free to limit to 1.
+class LineRenderer
+{
+    ShaderProgram *shader;
+    unsigned int VBO, VAO;
+    unsigned int instanceBuffer;
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // lines stay packed in instances; a handle names a line wherever
+    // removals move it, and only the slots in [dirtyBegin, dirtyEnd) need
+    // re-uploading
+    vector<LineInstance> instances;
+    vector<int> slotHandles;  // slot -> handle
+    vector<int> handleSlots;  // handle -> slot, -1 once removed
+    vector<int> freeHandles;
+    size_t gpuCapacity = 0;
+    size_t dirtyBegin = 0, dirtyEnd = 0;
+
+    void markDirty(size_t begin, size_t end)
+    {
+        version++;
+        if (dirtyBegin >= dirtyEnd)
+        {
+            dirtyBegin = begin;
+            dirtyEnd = end;
+        }
+        else
+        {
+            dirtyBegin = std::min(dirtyBegin, begin);
+            dirtyEnd = std::max(dirtyEnd, end);
+        }
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, matrixBuffer);
-        glBufferData(GL_ARRAY_BUFFER, _models.size() * sizeof(mat4), &_models.front(), GL_STATIC_DRAW);
+    // the lines of a width x height lattice are not stored: the ones that
+    // cross the view are generated, clipped to it, whenever the view changes
+    int latticeWidth = 0;
+    int latticeHeight = 0;
+    int latticeMajor = GRID_MAJOR_LINES;
+    unsigned int lattice = 1; // changes with the lattice, so every view regenerates
+
+public:
+    // changes whenever a line or the lattice does, but not when the lattice
+    // is only regenerated for another view
+    unsigned int version = 0;
 
-        // set attribute pointers for matrix (4 times vec4)
+    LatticeView liveView; // the one draw() without a view uses
 
-        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)0);
-        glEnableVertexAttribArray(1);
+    LineRenderer()
+    {
 
-        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(sizeof(vec4)));
-        glEnableVertexAttribArray(2);
+        const char *vertexShaderSource = "#version 330 core\n" CAMERA_BLOCK
+                                         "layout (location = 0) in vec2 aCorner; // along 0..1, across -1..1\n"
+                                         "layout (location = 1) in vec3 aStart;\n"
+                                         "layout (location = 2) in vec3 aEnd;\n"
+                                         "layout (location = 3) in float aWidth;\n"
+                                         "layout (location = 4) in vec4 aColor;\n"
+                                         "out vec4 color;\n"
+                                         "out float across; // pixels from the center of the line\n"
+                                         "out float halfWidth;\n"
+                                         "void main()\n"
+                                         "{\n"
+                                         "   vec4 start = viewProjection * vec4(aStart, 1.0);\n"
+                                         "   vec4 end = viewProjection * vec4(aEnd, 1.0);\n"
+                                         "   vec2 halfViewport = viewport.xy * 0.5;\n"
+                                         "   vec2 direction = (end.xy / end.w - start.xy / start.w) * halfViewport;\n"
+                                         "   direction = length(direction) > 0.0 ? normalize(direction) : vec2(1.0, 0.0);\n"
+                                         "   vec2 normal = vec2(-direction.y, direction.x);\n"
+                                         "   halfWidth = aWidth * 0.5;\n"
+                                         "   // one extra pixel each side for the anti-aliased edge; square caps\n"
+                                         "   across = aCorner.y * (halfWidth + 1.0);\n"
+                                         "   vec2 offset = normal * across + direction * (aCorner.x * 2.0 - 1.0) * halfWidth;\n"
+                                         "   vec4 position = mix(start, end, aCorner.x);\n"
+                                         "   gl_Position = position + vec4(offset / halfViewport * position.w, 0.0, 0.0);\n"
+                                         "   color = aColor;\n"
+                                         "}\0";
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n"
+                                           "in vec4 color;\n"
+                                           "in float across;\n"
+                                           "in float halfWidth;\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   float coverage = clamp(halfWidth + 0.5 - abs(across), 0.0, 1.0);\n"
+                                           "   FragColor = vec4(color.rgb, color.a * coverage);\n"
+                                           "}\n\0";
 
-        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(2 * sizeof(vec4)));
-        glEnableVertexAttribArray(3);
+        shader = &shaders.get(vertexShaderSource, fragmentShaderSource);
 
-        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (void *)(3 * sizeof(vec4)));
-        glEnableVertexAttribArray(4);
+        float corners[] = {
+            0.0f, -1.0f,
+            0.0f, 1.0f,
+            1.0f, -1.0f,
+            1.0f, 1.0f};
 
-        glVertexAttribDivisor(1, 1);
-        glVertexAttribDivisor(2, 1);
-        glVertexAttribDivisor(3, 1);
-        glVertexAttribDivisor(4, 1);
+        glGenBuffers(1, &VBO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
 
-        glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+        glGenBuffers(1, &instanceBuffer);
+        VAO = createVertexArray(instanceBuffer);
+        initView(liveView);
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-        glBufferData(GL_ARRAY_BUFFER, _colors.size() * sizeof(vec3), &_colors.front(), GL_STATIC_DRAW);
+    void initView(LatticeView &target)
+    {
+        glGenBuffers(1, &target.buffer);
+        target.VAO = createVertexArray(target.buffer);
+    }
 
-        glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-        glEnableVertexAttribArray(5);
-        glVertexAttribDivisor(5, 1);
+    // the shared corners plus one instance per line from lineBuffer
+    unsigned int createVertexArray(unsigned int lineBuffer)
+    {
+        unsigned int vertexArray;
+        glGenVertexArrays(1, &vertexArray);
+        glBindVertexArray(vertexArray);
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *)0);
+        glEnableVertexAttribArray(0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, lineBuffer);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(LineInstance), (void *)offsetof(LineInstance, start));
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(LineInstance), (void *)offsetof(LineInstance, end));
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(LineInstance), (void *)offsetof(LineInstance, width));
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(LineInstance), (void *)offsetof(LineInstance, color));
+        for (int i = 1; i <= 4; i++)
+        {
+            glEnableVertexAttribArray(i);
+            glVertexAttribDivisor(i, 1);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        return vertexArray;
+    }
+
+    // draw the lines of a width x height grid with a major line every major cells
+    void setLattice(int width, int height, int major = GRID_MAJOR_LINES)
+    {
+        latticeWidth = width;
+        latticeHeight = height;
+        latticeMajor = std::max(2, major);
+        lattice++;
+        version++;
+    }
+
+    // regenerate the lattice lines for the cells in [bottomLeft, topRight],
+    // which are pixelsPerCell apart on screen. Lines closer than
+    // GRID_LINE_MIN_SPACING are dropped: first the minor ones, leaving every
+    // major line, then every major'th major line and so on.
+    void setView(vec2 bottomLeft, vec2 topRight, float pixelsPerCell)
+    {
+        setView(liveView, bottomLeft, topRight, pixelsPerCell);
+    }
+
+    void setView(LatticeView &target, vec2 bottomLeft, vec2 topRight, float pixelsPerCell)
+    {
+        int step = 1;
+        while (step * pixelsPerCell < GRID_LINE_MIN_SPACING && step < std::max(latticeWidth, latticeHeight))
+        {
+            step = step == 1 ? latticeMajor : step * latticeMajor;
+        }
+
+        int view[5] = {
+            std::max(0, std::min(latticeWidth, (int)std::floor(bottomLeft.x))),
+            std::max(0, std::min(latticeHeight, (int)std::floor(bottomLeft.y))),
+            std::max(0, std::min(latticeWidth, (int)std::ceil(topRight.x) + 1)),
+            std::max(0, std::min(latticeHeight, (int)std::ceil(topRight.y) + 1)),
+            step};
+        if (std::equal(view, view + 5, target.bounds) && target.lattice == lattice)
+        {
+            return;
+        }
+        std::copy(view, view + 5, target.bounds);
+        target.lattice = lattice;
+
+        int x0 = view[0], y0 = view[1], x1 = view[2], y1 = view[3];
+        vector<LineInstance> &latticeInstances = target.instances;
+        latticeInstances.clear();
+        if (x0 < x1 && y0 < y1)
+        {
+            // lines that would survive one step coarser are drawn as major
+            // lines and the rest fainter; the outline of the grid is always
+            // kept and drawn as major
+            int majorStep = step * latticeMajor;
+            auto line = [&latticeInstances, majorStep](vec3 start, vec3 end, int at, bool outline)
+            {
+                bool major = outline || at % majorStep == 0;
+                latticeInstances.push_back(LineInstance{start, end, major ? GRID_LINE_WIDTH : GRID_MINOR_LINE_WIDTH,
+                                                        major ? GRID_LINE_COLOR : GRID_MINOR_LINE_COLOR});
+            };
+            // horizontal lines, clipped to the view, then vertical ones
+            for (int j = (y0 + step - 1) / step * step; j <= y1; j += step)
+            {
+                line(vec3(x0, j, 0), vec3(x1, j, 0), j, j == latticeHeight);
+            }
+            if (y1 == latticeHeight && latticeHeight % step != 0)
+            {
+                line(vec3(x0, y1, 0), vec3(x1, y1, 0), y1, true);
+            }
+            for (int i = (x0 + step - 1) / step * step; i <= x1; i += step)
+            {
+                line(vec3(i, y0, 0), vec3(i, y1, 0), i, i == latticeWidth);
+            }
+            if (x1 == latticeWidth && latticeWidth % step != 0)
+            {
+                line(vec3(x1, y0, 0), vec3(x1, y1, 0), x1, true);
+            }
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, target.buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(LineInstance) * latticeInstances.size(), latticeInstances.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // add a line and return a handle for setLine/removeLine
+    int addLine(vec3 start, vec3 end, float width, vec4 color, bool uploadImmediately = true)
+    {
+        LineInstance line{start, end, width, color};
+        int handle;
+        addLines(&line, 1, &handle, uploadImmediately);
+        return handle;
+    }
+
+    int addLine(vec3 start, vec3 end, bool uploadImmediately = true)
+    {
+        return addLine(start, end, GRID_LINE_WIDTH, GRID_LINE_COLOR, uploadImmediately);
+    }
+
+    // add count lines with one reserve and at most one upload; their handles
+    // are written to handles if it is not null
+    void addLines(const LineInstance *lines, size_t count, int *handles = nullptr, bool uploadImmediately = true)
+    {
+        size_t first = instances.size();
+        instances.reserve(first + count);
+        slotHandles.reserve(first + count);
+        instances.insert(instances.end(), lines, lines + count);
+        for (size_t i = 0; i < count; i++)
+        {
+            int handle;
+            if (!freeHandles.empty())
+            {
+                handle = freeHandles.back();
+                freeHandles.pop_back();
+                handleSlots[handle] = first + i;
+            }
+            else
+            {
+                handle = handleSlots.size();
+                handleSlots.push_back(first + i);
+            }
+            slotHandles.push_back(handle);
+            if (handles)
+            {
+                handles[i] = handle;
+            }
+        }
+        markDirty(first, instances.size());
+        if (uploadImmediately)
+        {
+            upload();
+        }
+    }
+
+    void addLines(const vector<LineInstance> &lines, vector<int> *handles = nullptr, bool uploadImmediately = true)
+    {
+        if (handles)
+        {
+            handles->resize(lines.size());
+        }
+        addLines(lines.data(), lines.size(), handles ? handles->data() : nullptr, uploadImmediately);
+    }
+
+    void setLine(int handle, const LineInstance &line)
+    {
+        int slot = handleSlots[handle];
+        instances[slot] = line;
+        markDirty(slot, slot + 1);
+    }
+
+    // the last line takes the removed line's slot, so only that slot changes;
+    // unknown or already removed handles are ignored
+    void removeLine(int handle)
+    {
+        if (handle < 0 || handle >= (int)handleSlots.size() || handleSlots[handle] < 0)
+        {
+            return;
+        }
+        int slot = handleSlots[handle];
+        int last = instances.size() - 1;
+        if (slot != last)
+        {
+            instances[slot] = instances[last];
+            slotHandles[slot] = slotHandles[last];
+            handleSlots[slotHandles[slot]] = slot;
+            markDirty(slot, slot + 1);
+        }
+        instances.pop_back();
+        slotHandles.pop_back();
+        handleSlots[handle] = -1;
+        version++;
+        freeHandles.push_back(handle);
+        dirtyEnd = std::min(dirtyEnd, instances.size());
+    }
+
+    void clearLines()
+    {
+        instances.clear();
+        slotHandles.clear();
+        handleSlots.clear();
+        freeHandles.clear();
+        dirtyBegin = dirtyEnd = 0;
+        version++;
+    }
+
+    // send the lines changed since the last upload to the GPU; the buffer
+    // grows geometrically so that appending does not reallocate it each time
+    void upload()
+    {
+        if (dirtyBegin >= dirtyEnd && instances.size() <= gpuCapacity)
+        {
+            return;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        if (instances.size() > gpuCapacity)
+        {
+            gpuCapacity = std::max(instances.size(), gpuCapacity * 2);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(LineInstance) * gpuCapacity, NULL, GL_DYNAMIC_DRAW);
+            dirtyBegin = 0;
+            dirtyEnd = instances.size();
+        }
+        if (dirtyBegin < dirtyEnd)
+        {
+            glBufferSubData(GL_ARRAY_BUFFER, sizeof(LineInstance) * dirtyBegin, sizeof(LineInstance) * (dirtyEnd - dirtyBegin), instances.data() + dirtyBegin);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        dirtyBegin = dirtyEnd = 0;
+    }
+
+    int draw()
+    {
+        return draw(liveView);
+    }
+
+    int draw(LatticeView &view)
+    {
+        upload();
+        glUseProgram(shader->id);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        glBindVertexArray(VAO);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances.size());
+        glBindVertexArray(view.VAO);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, view.instances.size());
+        glBindVertexArray(0);
+        glDisable(GL_BLEND);
+        return 0;
+    }
+};
+
+// maths functions to pick which grid (not necessary, just for demonstration purposes)
+
+vec3 rayCast(double xpos, double ypos, mat4 projection, mat4 view)
+{
+    // converts a position from the 2d xpos, ypos to a normalized 3d direction
+    float x = (2.0f * xpos) / SCR_WIDTH - 1.0f;
+    float y = 1.0f - (2.0f * ypos) / SCR_HEIGHT;
+    float z = 1.0f;
+    vec3 ray_nds = vec3(x, y, z);
+    vec4 ray_clip = vec4(ray_nds.x, ray_nds.y, -1.0f, 1.0f);
+    // eye space to clip we would multiply by projection so
+    // clip space to eye space is the inverse projection
+    vec4 ray_eye = inverse(projection) * ray_clip;
+    // convert point to forwards
+    ray_eye = vec4(ray_eye.x, ray_eye.y, -1.0f, 0.0f);
+    // world space to eye space is usually multiply by view so
+    // eye space to world space is inverse view
+    vec4 inv_ray_wor = (inverse(view) * ray_eye);
+    vec3 ray_wor = vec3(inv_ray_wor.x, inv_ray_wor.y, inv_ray_wor.z);
+    ray_wor = normalize(ray_wor);
+    return ray_wor;
+}
+
+vec3 rayPlaneIntersection(vec3 ray_position, vec3 ray_direction, vec3 plane_normal, vec3 plane_position)
+{
+    float d = dot(plane_normal, plane_position - ray_position) / (0.001 + dot(ray_direction, plane_normal));
+    return ray_position + ray_direction * d;
+}
+
+// in builds with GRID_COUNT_ALLOCATIONS defined (make bench and make
+// grid-allocations) every heap allocation is counted, so that allocations in
+// what should be allocation-free frames show up in --allocations and make
+// bench; other builds keep the standard allocator. The aligned and nothrow
+// forms are replaced too, since the library versions of those do not all go
+// through operator new(size_t)
+#ifdef GRID_COUNT_ALLOCATIONS
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> allocatedBytes{0};
+
+void *countedAlloc(size_t size, size_t alignment)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (alignment <= alignof(std::max_align_t))
+    {
+        return malloc(size ? size : 1);
+    }
+    // aligned_alloc wants a size that is a multiple of the alignment
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void *operator new(size_t size)
+{
+    if (void *p = countedAlloc(size, 0))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    if (void *p = countedAlloc(size, (size_t)alignment))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size, (size_t)alignment);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size, 0);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size, (size_t)alignment);
+}
+
+// malloc and aligned_alloc memory are both released with free; kept out
+// of line so that gcc does not see free() paired with operator new
+__attribute__((noinline)) void countedFree(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p) noexcept
+{
+    countedFree(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    countedFree(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    countedFree(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    countedFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    countedFree(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    countedFree(p);
+}
+#endif
+
+double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template <typename T>
+vector<T> flatten(const vector<vector<T>> &orig, vec2 bottomLeft = vec2(0, 0), vec2 topRight = vec2(GRID_WIDTH, GRID_HEIGHT))
+{
+    vector<T> ret;
+    // for(const auto &v: orig)
+    //     ret.insert(ret.end(), v.begin(), v.end());
+    float rx = (topRight.x >= GRID_WIDTH ? GRID_WIDTH : topRight.x + 1);
+    float ry = (topRight.y >= GRID_HEIGHT ? GRID_HEIGHT : topRight.y + 1);
+
+    float lx = (bottomLeft.x <= 0 ? 0 : bottomLeft.x);
+    float ly = (bottomLeft.y <= 0 ? 0 : bottomLeft.y);
+
+    ret.reserve(std::max(0, (int)rx - (int)lx) * std::max(0, (int)ry - (int)ly));
+    for (int i = lx; i < rx; i++)
+    {
+        const vector<T> &v = orig[i];
+        ret.insert(ret.end(), v.begin() + ly, v.begin() + ry);
+    }
+    return ret;
+}
+
+// SIMD kernels for finding the occupied cells of an array of colors, one
+// implementation per instruction set; the best one the CPU supports is
+// picked at startup, so a single binary runs on any x86-64 machine
+
+// set bit i of bits, (count + 63) / 64 words, when colors[i] is not vec3(0)
+typedef void (*OccupancyKernel)(const vec3 *colors, size_t count, uint64_t *bits);
+// write the positions of the set bits among the first count to indices and
+// return how many there are; indices needs COMPACT_SLACK entries of slack at
+// the end
+typedef size_t (*CompactKernel)(const uint64_t *bits, size_t count, uint32_t *indices);
+
+// the widest store a compaction kernel makes past the last index: AVX2 writes
+// 8 indices for every byte of bits, however few are set
+const size_t COMPACT_SLACK = 8;
+
+// the vector kernels pay per non-empty byte or quarter of a word however
+// few of its bits are set, so words with fewer set bits than this are
+// walked bit by bit as compactScalar does
+const int COMPACT_SPARSE_BITS = 16;
+
+struct SimdKernels
+{
+    const char *name;
+    OccupancyKernel occupancy;
+    CompactKernel compact;
+};
+
+void occupancyScalar(const vec3 *colors, size_t count, uint64_t *bits)
+{
+    std::fill(bits, bits + (count + 63) / 64, 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (colors[i] != vec3(0))
+        {
+            bits[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
+
+size_t compactScalar(const uint64_t *bits, size_t count, uint32_t *indices)
+{
+    size_t n = 0;
+    for (size_t word = 0; word * 64 < count; word++)
+    {
+        uint64_t w = bits[word];
+        if (count - word * 64 < 64)
+        {
+            w &= (1ull << (count - word * 64)) - 1;
+        }
+        for (; w; w &= w - 1)
+        {
+            indices[n++] = word * 64 + __builtin_ctzll(w);
+        }
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// for each byte, the positions of its set bits packed four bits apiece
+struct CompactTable
+{
+    uint32_t positions[256];
+
+    CompactTable()
+    {
+        for (int byte = 0; byte < 256; byte++)
+        {
+            uint32_t packed = 0;
+            int n = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                if (byte & 1 << bit)
+                {
+                    packed |= bit << 4 * n++;
+                }
+            }
+            positions[byte] = packed;
+        }
+    }
+};
+
+const CompactTable compactTable;
+
+__attribute__((target("avx2"))) void occupancyAVX2(const vec3 *colors, size_t count, uint64_t *bits)
+{
+    std::fill(bits, bits + (count + 63) / 64, 0);
+    const float *base = &colors[0].x;
+    const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256 zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const float *cell = base + 3 * i;
+        __m256 r = _mm256_cmp_ps(_mm256_i32gather_ps(cell, stride, 4), zero, _CMP_NEQ_UQ);
+        __m256 g = _mm256_cmp_ps(_mm256_i32gather_ps(cell + 1, stride, 4), zero, _CMP_NEQ_UQ);
+        __m256 b = _mm256_cmp_ps(_mm256_i32gather_ps(cell + 2, stride, 4), zero, _CMP_NEQ_UQ);
+        uint64_t mask = _mm256_movemask_ps(_mm256_or_ps(_mm256_or_ps(r, g), b));
+        bits[i / 64] |= mask << (i % 64);
+    }
+    for (; i < count; i++)
+    {
+        if (colors[i] != vec3(0))
+        {
+            bits[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
+
+__attribute__((target("avx2"))) size_t compactAVX2(const uint64_t *bits, size_t count, uint32_t *indices)
+{
+    const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+    const __m256i nibble = _mm256_set1_epi32(0xf);
+    size_t n = 0;
+    for (size_t word = 0; word * 64 < count; word++)
+    {
+        uint64_t w = bits[word];
+        if (count - word * 64 < 64)
+        {
+            w &= (1ull << (count - word * 64)) - 1;
+        }
+        if (__builtin_popcountll(w) < COMPACT_SPARSE_BITS)
+        {
+            for (; w; w &= w - 1)
+            {
+                indices[n++] = word * 64 + __builtin_ctzll(w);
+            }
+            continue;
+        }
+        for (int byte = 0; w; byte++, w >>= 8)
+        {
+            uint32_t set = w & 0xff;
+            if (!set)
+            {
+                continue;
+            }
+            __m256i positions = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(compactTable.positions[set]), shifts), nibble);
+            positions = _mm256_add_epi32(positions, _mm256_set1_epi32(word * 64 + byte * 8));
+            _mm256_storeu_si256((__m256i *)(indices + n), positions);
+            n += __builtin_popcount(set);
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx512f"))) void occupancyAVX512(const vec3 *colors, size_t count, uint64_t *bits)
+{
+    std::fill(bits, bits + (count + 63) / 64, 0);
+    const float *base = &colors[0].x;
+    const __m512i stride = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21, 24, 27, 30, 33, 36, 39, 42, 45);
+    const __m512 zero = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const float *cell = base + 3 * i;
+        uint64_t mask = _mm512_cmp_ps_mask(_mm512_mask_i32gather_ps(zero, 0xffff, stride, cell, 4), zero, _CMP_NEQ_UQ) |
+                        _mm512_cmp_ps_mask(_mm512_mask_i32gather_ps(zero, 0xffff, stride, cell + 1, 4), zero, _CMP_NEQ_UQ) |
+                        _mm512_cmp_ps_mask(_mm512_mask_i32gather_ps(zero, 0xffff, stride, cell + 2, 4), zero, _CMP_NEQ_UQ);
+        bits[i / 64] |= mask << (i % 64);
+    }
+    for (; i < count; i++)
+    {
+        if (colors[i] != vec3(0))
+        {
+            bits[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) size_t compactAVX512(const uint64_t *bits, size_t count, uint32_t *indices)
+{
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t n = 0;
+    for (size_t word = 0; word * 64 < count; word++)
+    {
+        uint64_t w = bits[word];
+        if (count - word * 64 < 64)
+        {
+            w &= (1ull << (count - word * 64)) - 1;
+        }
+        if (__builtin_popcountll(w) < COMPACT_SPARSE_BITS)
+        {
+            for (; w; w &= w - 1)
+            {
+                indices[n++] = word * 64 + __builtin_ctzll(w);
+            }
+            continue;
+        }
+        for (int quarter = 0; w; quarter++, w >>= 16)
+        {
+            __mmask16 set = w & 0xffff;
+            if (!set)
+            {
+                continue;
+            }
+            __m512i positions = _mm512_add_epi32(lanes, _mm512_set1_epi32(word * 64 + quarter * 16));
+            _mm512_mask_compressstoreu_epi32(indices + n, set, positions);
+            n += __builtin_popcount(set);
+        }
+    }
+    return n;
+}
+
+#endif
+
+// the kernels this CPU can run, best last
+vector<SimdKernels> supportedKernels()
+{
+    vector<SimdKernels> kernels = {{"scalar", occupancyScalar, compactScalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back({"avx2", occupancyAVX2, compactAVX2});
+    }
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        kernels.push_back({"avx512", occupancyAVX512, compactAVX512});
+    }
+#endif
+    return kernels;
+}
+
+const SimdKernels simd = supportedKernels().back();
+
+// a run of identical cells in a compressed row
+struct CellRun
+{
+    vec3 color;
+    uint32_t length : 31;
+    uint32_t initialized : 1; // addQuad was called, i.e. the cell is not empty
+};
+
+// what an edit can change about a cell
+struct CellState
+{
+    vec3 color;
+    bool initialized;
+
+    bool operator==(const CellState &other) const
+    {
+        return color == other.color && initialized == other.initialized;
+    }
+};
+
+// cells [x0, x1) x [y0, y1)
+struct CellRect
+{
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    bool empty() const
+    {
+        return x0 >= x1 || y0 >= y1;
+    }
+
+    bool operator==(const CellRect &other) const
+    {
+        return x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1;
+    }
+
+    // grow to cover other as well
+    void add(const CellRect &other)
+    {
+        if (other.empty())
+        {
+            return;
+        }
+        if (empty())
+        {
+            *this = other;
+            return;
+        }
+        x0 = std::min(x0, other.x0);
+        y0 = std::min(y0, other.y0);
+        x1 = std::max(x1, other.x1);
+        y1 = std::max(y1, other.y1);
+    }
+};
+
+// what the vertex shader draws for one quad: the rectangle it covers and its
+// color, read as two RGBA32F texels from a texture buffer
+struct CellRecord
+{
+    vec4 rect; // x, y, width, height
+    vec4 color;
+};
+
+#define CELL_RECORD_SHADER                                                   \
+    "uniform samplerBuffer cellRecords;\n"                                   \
+    "uniform int firstRecord;\n"                                             \
+    "layout (location = 0) in vec3 aPos;\n"                                  \
+    "out vec3 color;\n"                                                      \
+    "void main()\n"                                                          \
+    "{\n"                                                                    \
+    "   int record = (firstRecord + gl_InstanceID) * 2;\n"                   \
+    "   vec4 rect = texelFetch(cellRecords, record);\n"                      \
+    "   gl_Position = viewProjection * vec4(rect.xy + aPos.xy * rect.zw, 0.0, 1.0);\n" \
+    "   color = texelFetch(cellRecords, record + 1).rgb;\n"                  \
+    "}\0"
+
+// a GPU array of cell records that shaders pull from by index, so a subset
+// is drawn by its first record alone and a record is updated in place.
+// GL 3.3 only promises texture buffers of 65536 texels, so the records are
+// split into pages of as many as the driver allows, drawn a page at a time.
+class CellRecordBuffer
+{
+    vector<unsigned int> buffers, textures;
+    size_t pageRecords;
+    size_t maxPageRecords; // what one texture buffer can hold
+
+    // (re)allocate every page for capacity records in all
+    void allocate()
+    {
+        pageRecords = std::min(capacity, maxPageRecords);
+        size_t pages = (capacity + pageRecords - 1) / pageRecords;
+        size_t had = buffers.size();
+        if (pages > had)
+        {
+            buffers.resize(pages);
+            textures.resize(pages);
+            glGenBuffers(pages - had, buffers.data() + had);
+            glGenTextures(pages - had, textures.data() + had);
+        }
+        for (size_t page = 0; page < pages; page++)
+        {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[page]);
+            glBufferData(GL_TEXTURE_BUFFER, pageRecords * sizeof(CellRecord), NULL, GL_DYNAMIC_DRAW);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[page]);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffers[page]);
+        }
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+public:
+    size_t capacity;
+
+    CellRecordBuffer(size_t capacity) : capacity(std::max<size_t>(capacity, 1))
+    {
+        int maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        maxPageRecords = (size_t)std::max(maxTexels, 2) / 2;
+        allocate();
+    }
+
+    // make room for count records, at least doubling the capacity when it
+    // grows; the records written so far are lost if it does
+    void reserve(size_t count)
+    {
+        if (count <= capacity)
+        {
+            return;
+        }
+        capacity = std::max(count, capacity * 2);
+        allocate();
+    }
+
+    size_t pages()
+    {
+        return buffers.size();
+    }
+
+    void write(size_t first, const CellRecord *records, size_t count)
+    {
+        while (count > 0)
+        {
+            size_t page = first / pageRecords, offset = first % pageRecords;
+            size_t n = std::min(count, pageRecords - offset);
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[page]);
+            glBufferSubData(GL_TEXTURE_BUFFER, offset * sizeof(CellRecord), n * sizeof(CellRecord), records);
+            first += n;
+            records += n;
+            count -= n;
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // draw records [first, first + count) as instances of the bound VAO's
+    // quad with program, which must be in use; one draw per page they span
+    void draw(ShaderProgram &program, size_t first, size_t count)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(program.uniform("cellRecords"), 0);
+        while (count > 0)
+        {
+            size_t page = first / pageRecords, offset = first % pageRecords;
+            size_t n = std::min(count, pageRecords - offset);
+            glBindTexture(GL_TEXTURE_BUFFER, textures[page]);
+            glUniform1i(program.uniform("firstRecord"), offset);
+            glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, n);
+            first += n;
+            count -= n;
+        }
+    }
+};
+
+// a fixed set of threads that, together with the caller, run the chunks of
+// one parallel loop at a time
+class ThreadPool
+{
+    vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    // the current run, written under the mutex and read by each worker under
+    // it when it wakes
+    void (*task)(const void *, int) = nullptr;
+    const void *taskContext = nullptr;
+    int chunks = 0;
+    unsigned int generation = 0;
+    bool stopping = false;
+
+    // workers still claiming chunks; the counters below are only reset
+    // once none are, so no index from one run is checked against the next
+    int active = 0;
+    std::condition_variable idle;
+    std::atomic<int> next{0};
+    std::atomic<int> completed{0};
+
+    void runChunks(void (*call)(const void *, int), const void *context, int count)
+    {
+        for (int chunk = next++; chunk < count; chunk = next++)
+        {
+            call(context, chunk);
+            if (++completed == count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished.notify_all();
+            }
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        unsigned int seen = 0;
+        while (true)
+        {
+            wake.wait(lock, [this, &seen]
+                      { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+            void (*call)(const void *, int) = task;
+            const void *context = taskContext;
+            int count = chunks;
+            active++;
+            lock.unlock();
+            runChunks(call, context, count);
+            lock.lock();
+            if (--active == 0)
+            {
+                idle.notify_all();
+            }
+        }
+    }
+
+public:
+    ThreadPool(unsigned int size = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        // the calling thread is the last member of the pool
+        for (unsigned int i = 1; i < size; i++)
+        {
+            threads.emplace_back(&ThreadPool::work, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    unsigned int size()
+    {
+        return threads.size() + 1;
+    }
+
+    // call chunk(0) .. chunk(count - 1) across the pool and return when all
+    // are done; chunk is called through a plain pointer, so unlike a
+    // std::function nothing is allocated per loop
+    template <typename Chunk>
+    void run(int count, const Chunk &chunk)
+    {
+        run(count, [](const void *context, int i)
+            { (*(const Chunk *)context)(i); },
+            &chunk);
+    }
+
+    void run(int count, void (*call)(const void *, int), const void *context)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [this]
+                      { return active == 0; });
+            task = call;
+            taskContext = context;
+            completed = 0;
+            chunks = count;
+            next = 0;
+            generation++;
+        }
+        wake.notify_all();
+        runChunks(call, context, count);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this, count]
+                      { return completed == count; });
+    }
+};
+
+// packs cell records on a worker thread. It keeps its own copy of the runs
+// of every row, brought up to date from the rows each job says changed, so
+// it never reads the grid while the render thread edits it, and never
+// touches GL.
+class RecordPacker
+{
+public:
+    // jobs are swapped between the caller and the worker rather than
+    // rebuilt, so once their buffers have grown they are only ever reused
+    struct Job
+    {
+        int x0, x1, y0, y1; // rows [x0, x1), columns [y0, y1)
+        bool mergeRuns;
+
+        // the new runs of changed row rows[i] are runs[runStarts[i], runStarts[i + 1]),
+        // and its shaded cells bits[i * rowWords, (i + 1) * rowWords)
+        vector<int> rows;
+        vector<size_t> runStarts;
+        vector<CellRun> runs;
+        vector<uint64_t> bits;
+
+        void clear()
+        {
+            rows.clear();
+            runStarts.assign(1, 0);
+            runs.clear();
+            bits.clear();
+        }
+
+        // returns where the row's shaded bits go
+        uint64_t *addRow(int x, const vector<CellRun> &rowRuns)
+        {
+            rows.push_back(x);
+            runs.insert(runs.end(), rowRuns.begin(), rowRuns.end());
+            runStarts.push_back(runs.size());
+            bits.resize(bits.size() + rowWords);
+            return bits.data() + bits.size() - rowWords;
+        }
+
+    private:
+        int rowWords = (GRID_HEIGHT + 63) / 64;
+    };
+
+    const int rowWords = (GRID_HEIGHT + 63) / 64;
+
+private:
+    vector<vector<CellRun>> mirror;
+    vector<vector<uint64_t>> mirrorBits; // bit y of row x set when the cell is shaded
+    ThreadPool pool;
+    vector<size_t> chunkOffsets;
+    vector<vector<uint32_t>> chunkIndices; // compacted cell positions, per chunk
+    Job current; // the worker's
+
+    // shared with the worker
+    std::mutex mutex;
+    std::condition_variable wake;
+    Job job;
+    bool queued = false;
+    bool done = false;
+    bool stopping = false;
+    vector<CellRecord> packed;
+    std::thread worker;
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this]
+                      { return stopping || queued; });
+            if (stopping)
+            {
+                return;
+            }
+            queued = false;
+            std::swap(current, job);
+            vector<CellRecord> records = std::move(packed);
+            lock.unlock();
+
+            double start = now();
+            for (size_t i = 0; i < current.rows.size(); i++)
+            {
+                mirror[current.rows[i]].assign(current.runs.begin() + current.runStarts[i], current.runs.begin() + current.runStarts[i + 1]);
+                mirrorBits[current.rows[i]].assign(current.bits.begin() + i * rowWords, current.bits.begin() + (i + 1) * rowWords);
+            }
+            pack(current, records);
+            double seconds = now() - start;
+
+            lock.lock();
+            packed = std::move(records);
+            packSeconds = seconds;
+            done = true;
+            wake.notify_all();
+            // wake the render thread to take the records
+            requestRedraw();
+        }
+    }
+
+    // call shaded(start, end, color) for each run of shaded cells in row x,
+    // clipped to the window
+    template <typename Shaded>
+    void forEachRun(const Job &job, int x, Shaded shaded)
+    {
+        int y = 0;
+        for (const CellRun &run : mirror[x])
+        {
+            int start = std::max(y, job.y0);
+            int end = std::min<int>(y + run.length, job.y1);
+            if (start < end && run.initialized && run.color != vec3(0))
+            {
+                shaded(start, end, run.color);
+            }
+            y += run.length;
+            if (y >= job.y1)
+            {
+                break;
+            }
+        }
+    }
+
+    // the shaded cells of row x in [y0, y1)
+    size_t countShaded(int x, int y0, int y1)
+    {
+        const vector<uint64_t> &bits = mirrorBits[x];
+        size_t n = 0;
+        for (int word = y0 / 64; word * 64 < y1; word++)
+        {
+            uint64_t w = bits[word];
+            if (word == y0 / 64)
+            {
+                w &= ~0ull << (y0 % 64);
+            }
+            if (y1 - word * 64 < 64)
+            {
+                w &= (1ull << (y1 - word * 64)) - 1;
+            }
+            n += __builtin_popcountll(w);
+        }
+        return n;
+    }
+
+    // one record per shaded cell of row x in the window, found by the
+    // compaction kernel; colors are read from the runs alongside
+    CellRecord *packCells(const Job &job, int x, vector<uint32_t> &indices, CellRecord *out)
+    {
+        int base = job.y0 / 64 * 64;
+        size_t n = simd.compact(mirrorBits[x].data() + base / 64, job.y1 - base, indices.data());
+        auto run = mirror[x].begin();
+        int runEnd = run->length;
+        for (size_t i = 0; i < n; i++)
+        {
+            int y = base + indices[i];
+            if (y < job.y0)
+            {
+                continue;
+            }
+            while (y >= runEnd)
+            {
+                runEnd += (++run)->length;
+            }
+            *out++ = CellRecord{vec4(x, y, 1, 1), vec4(run->color, 1)};
+        }
+        return out;
+    }
+
+    // one record per run of shaded cells, or per cell, clipped to the window.
+    // The rows are split into chunks; the pool counts each chunk's records,
+    // a prefix sum gives each chunk its offset, and the pool then writes
+    // every chunk straight into its place in records. Cells are counted and
+    // found from the shaded bitmaps with the SIMD kernels.
+    void pack(const Job &job, vector<CellRecord> &records)
+    {
+        int rows = job.x1 - job.x0;
+        int count = std::min<int>(rows, pool.size() * 4);
+        chunkOffsets.assign(count + 1, 0);
+        if (!job.mergeRuns && (int)chunkIndices.size() < count)
+        {
+            chunkIndices.resize(count, vector<uint32_t>(GRID_HEIGHT + COMPACT_SLACK));
+        }
+        auto chunkRows = [&job, rows, count](int chunk, int &x0, int &x1)
+        {
+            x0 = job.x0 + (long)rows * chunk / count;
+            x1 = job.x0 + (long)rows * (chunk + 1) / count;
+        };
+
+        pool.run(count, [&](int chunk)
+                 {
+                     int x0, x1;
+                     chunkRows(chunk, x0, x1);
+                     size_t n = 0;
+                     for (int x = x0; x < x1; x++)
+                     {
+                         if (job.mergeRuns)
+                         {
+                             forEachRun(job, x, [&n](int, int, vec3)
+                                        { n++; });
+                         }
+                         else
+                         {
+                             n += countShaded(x, job.y0, job.y1);
+                         }
+                     }
+                     chunkOffsets[chunk + 1] = n; });
+
+        for (int chunk = 0; chunk < count; chunk++)
+        {
+            chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+        }
+        records.resize(chunkOffsets[count]);
+
+        pool.run(count, [&](int chunk)
+                 {
+                     int x0, x1;
+                     chunkRows(chunk, x0, x1);
+                     CellRecord *out = records.data() + chunkOffsets[chunk];
+                     for (int x = x0; x < x1; x++)
+                     {
+                         if (!job.mergeRuns)
+                         {
+                             out = packCells(job, x, chunkIndices[chunk], out);
+                             continue;
+                         }
+                         forEachRun(job, x, [&out, x](int start, int end, vec3 color)
+                                    { *out++ = CellRecord{vec4(x, start, 1, end - start), vec4(color, 1)}; });
+                     } });
+    }
+
+public:
+    double packSeconds = 0; // of the last job, valid once it is taken
+
+    RecordPacker(int rows) : mirror(rows), mirrorBits(rows, vector<uint64_t>(rowWords)), worker(&RecordPacker::work, this)
+    {
+    }
+
+    ~RecordPacker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // at most one job is in flight: submit only after taking the last result.
+    // next is left holding an old job, to be cleared and refilled
+    void submit(Job &next)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(job, next);
+        queued = true;
+        done = false;
+        wake.notify_all();
+    }
+
+    bool ready()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done;
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]
+                  { return done; });
+    }
+
+    // wait for the job to finish and swap its records into records, whose
+    // old contents the worker reuses for the next job
+    void take(vector<CellRecord> &records)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]
+                  { return done; });
+        records.swap(packed);
+        done = false;
+    }
+};
+
+class QuadRenderer
+{
+
+public:
+    ShaderProgram *shader;
+    unsigned int VBO, VAO, EBO;
+
+    // the shaded cells in view, and for every cell of the window that starts
+    // a record its index, or -1; both grow to fit the largest window packed
+    // rather than the grid
+    CellRecordBuffer *records = nullptr;
+    vector<CellRecord> shadedRecords;
+    vector<int> cellRecord;
+
+    // updates are packed by packer from the rows whose version changed
+    // since they were last sent to it; the previous records are drawn
+    // until the new ones are taken
+    RecordPacker *packer = nullptr;
+    RecordPacker::Job job;
+    vector<uint32_t> rowVersion;
+    vector<uint32_t> sentVersion;
+    vector<CellRecord> pendingRecords;
+    bool updating = false;
+    int updateRows = 0;
+
+    // the cells the records cover, the screen's pixels per cell when they
+    // were packed, and the part of them redrawn since dirty was last reset
+    CellRect window;
+    float windowPixelsPerCell = 0;
+    CellRect dirty;
+    CellRect pendingWindow, pendingDirty;
+    float pendingPixelsPerCell = 0;
+
+    vector<vector<vec3>> colors;
+
+    // bit y of occupied[x] is set when cell (x, y) is initialized, so tests
+    // read one bit rather than compare a mat4; kept for expanded rows only
+    vector<vector<uint64_t>> occupied;
+    const int rowWords = (GRID_HEIGHT + 63) / 64;
+
+    vec2 bottomLeft = vec2(0, 0);
+    vec2 topRight = vec2(GRID_WIDTH, GRID_HEIGHT);
+    float viewMargin = 0; // also pack this fraction of the view size beyond each side
+
+    // cold rows release their colors and occupancy and keep only their runs
+    vector<vector<CellRun>> compressedRows;
+    vector<double> rowLastUsed;
+    unsigned int coldRowCursor = 0;
+
+    // draw each run of identical cells in a row as one stretched quad; the
+    // runs of an uncompressed row are rebuilt only after it is edited
+    bool mergeRuns = true;
+    vector<vector<CellRun>> rowRuns;
+    vector<char> rowRunsStale;
+
+    // a renderer that is not dense holds no cells, only the view, the shader
+    // and the unit quad, for grids streamed from tiles to draw with
+    QuadRenderer(bool dense = true)
+    {
+        if (dense)
+        {
+            create();
+        }
+
+        // per-cell data is pulled from the record buffer by instance, so the
+        // vertex array only holds the unit quad
+        const char *vertexShaderSource = "#version 330 core\n" CAMERA_BLOCK CELL_RECORD_SHADER;
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n"
+                                           "in vec3 color;\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   FragColor = vec4(color,1);\n"
+                                           "}\n\0";
+
+        shader = &shaders.get(vertexShaderSource, fragmentShaderSource);
+
+        float vertices[] = {
+            1.0f, 1.0f, 0.0f, // top right
+            1.0f, 0.0f, 0.0f, // bottom right
+            0.0f, 0.0f, 0.0f, // bottom left
+            0.0f, 1.0f, 0.0f  // top left
+        };
+
+        unsigned int indices[] = {
+            // note that we start from 0!
+            0, 1, 3, // first Triangle
+            1, 2, 3  // second Triangle
+        };
+
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+
+        // bind the Vertex Array Object first, then bind and set vertex buffer(s), and then configure vertex attributes(s).
+        glBindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
+        glEnableVertexAttribArray(0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    ~QuadRenderer()
+    {
+        delete packer;
+        delete records;
+    }
+
+    // create an empty grid, each row a single compressed run until it is used
+    void create()
+    {
+        colors.resize(GRID_WIDTH);
+        occupied.resize(GRID_WIDTH);
+        compressedRows.assign(GRID_WIDTH, vector<CellRun>{CellRun{vec3(0), GRID_HEIGHT, 0}});
+        rowLastUsed.resize(GRID_WIDTH, now());
+        rowRuns.resize(GRID_WIDTH);
+        rowRunsStale.assign(GRID_WIDTH, 1);
+        rowVersion.assign(GRID_WIDTH, 0);
+        sentVersion.assign(GRID_WIDTH, ~0u);
+        records = new CellRecordBuffer(GRID_HEIGHT);
+        packer = new RecordPacker(GRID_WIDTH);
+    }
+
+    // a new vertex array holding just the unit quad, for others to draw it
+    unsigned int shareQuad()
+    {
+        unsigned int vertexArray;
+        glGenVertexArrays(1, &vertexArray);
+        glBindVertexArray(vertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
+        glEnableVertexAttribArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        return vertexArray;
+    }
+
+    void calculateFrustum()
+    {
+        vec3 rayWorld = rayCast(0, SCR_HEIGHT, projection, view);
+        vec3 worldPos = rayPlaneIntersection(cameraPos, rayWorld, vec3(0, 0, 1), vec3(0, 0, 0));
+        bottomLeft = vec2((int)worldPos.x, (int)worldPos.y);
+
+        rayWorld = rayCast(SCR_WIDTH, 0, projection, view);
+        worldPos = rayPlaneIntersection(cameraPos, rayWorld, vec3(0, 0, 1), vec3(0, 0, 0));
+        topRight = vec2((int)worldPos.x, (int)worldPos.y);
+    }
+
+    float pixelsPerCell()
+    {
+        return SCR_WIDTH / std::max(1.0f, topRight.x - bottomLeft.x + 1);
+    }
+
+    // the cells an update packs: the view and its margin, within the grid
+    CellRect packWindow()
+    {
+        vec2 margin = (topRight - bottomLeft + 1.0f) * viewMargin;
+        CellRect w;
+        w.x0 = std::max(0.0f, std::floor(bottomLeft.x - margin.x));
+        w.x1 = std::max(w.x0, (int)std::min((float)GRID_WIDTH, std::ceil(topRight.x + margin.x) + 1));
+        w.y0 = std::max(0.0f, std::floor(bottomLeft.y - margin.y));
+        w.y1 = std::max(w.y0, (int)std::min((float)GRID_HEIGHT, std::ceil(topRight.y + margin.y) + 1));
+        return w;
+    }
+
+    // send updated data to GPU
+    void update()
+    {
+        beginUpdate();
+        finishUpdate();
+    }
+
+    // hand the window and the rows changed since the last update to the
+    // packer; returns the number of rows in the window
+    int beginUpdate()
+    {
+        pendingWindow = packWindow();
+        pendingPixelsPerCell = pixelsPerCell();
+        pendingDirty = CellRect();
+
+        job.clear();
+        job.x0 = pendingWindow.x0;
+        job.x1 = pendingWindow.x1;
+        job.y0 = pendingWindow.y0;
+        job.y1 = pendingWindow.y1;
+        job.mergeRuns = mergeRuns;
+
+        double time = now();
+        for (int x = job.x0; x < job.x1; x++)
+        {
+            rowLastUsed[x] = time;
+            if (sentVersion[x] != rowVersion[x])
+            {
+                shadedBits(x, job.addRow(x, runs(x)));
+                sentVersion[x] = rowVersion[x];
+                pendingDirty.add(CellRect{x, job.y0, x + 1, job.y1});
+            }
+        }
+        updateRows = job.x1 - job.x0;
+        packer->submit(job);
+        updating = true;
+        return updateRows;
+    }
+
+    bool updateReady()
+    {
+        return packer->ready();
+    }
+
+    void waitUpdate()
+    {
+        packer->wait();
+    }
+
+    // take the packed records, waiting for them if need be, and upload them
+    void finishUpdate()
+    {
+        packer->take(pendingRecords);
+        for (const CellRecord &record : shadedRecords)
+        {
+            cellRecord[recordIndex((int)record.rect.x, (int)record.rect.y)] = -1;
+        }
+        shadedRecords.swap(pendingRecords);
+        if (!(pendingWindow == window))
+        {
+            window = pendingWindow;
+            pendingDirty = window;
+        }
+
+        // a merged run is found from its first cell, which the packer
+        // clipped to the window
+        size_t windowCells = (size_t)(window.x1 - window.x0) * (window.y1 - window.y0);
+        if (cellRecord.size() < windowCells)
+        {
+            cellRecord.resize(windowCells, -1);
+        }
+        for (size_t i = 0; i < shadedRecords.size(); i++)
+        {
+            cellRecord[recordIndex((int)shadedRecords[i].rect.x, (int)shadedRecords[i].rect.y)] = i;
+        }
+
+        records->reserve(shadedRecords.size());
+        records->write(0, shadedRecords.data(), shadedRecords.size());
+        updating = false;
+        windowPixelsPerCell = pendingPixelsPerCell;
+        dirty.add(pendingDirty);
+    }
+
+    // where cellRecord holds cell (x, y) of the window
+    size_t recordIndex(int x, int y)
+    {
+        return (size_t)(x - window.x0) * (window.y1 - window.y0) + (y - window.y0);
+    }
+
+    // row x was edited: its runs must be rebuilt and sent to the packer
+    void changed(int x)
+    {
+        rowRunsStale[x] = 1;
+        rowVersion[x]++;
+    }
+
+    const vector<CellRun> &runs(int x)
+    {
+        if (isCompressed(x))
+        {
+            return compressedRows[x];
+        }
+        if (rowRunsStale[x])
+        {
+            compressRow(occupied[x], colors[x], rowRuns[x]);
+            rowRunsStale[x] = 0;
+        }
+        return rowRuns[x];
+    }
+
+    // set bit y of bits when cell (x, y) is initialized and not black, i.e.
+    // drawn; expanded rows run the occupancy kernel over their colors
+    void shadedBits(int x, uint64_t *bits)
+    {
+        if (isCompressed(x))
+        {
+            std::fill(bits, bits + rowWords, 0);
+            int y = 0;
+            for (const CellRun &run : compressedRows[x])
+            {
+                for (int i = y; run.initialized && run.color != vec3(0) && i < y + (int)run.length; i++)
+                {
+                    bits[i / 64] |= 1ull << (i % 64);
+                }
+                y += run.length;
+            }
+            return;
+        }
+        simd.occupancy(colors[x].data(), GRID_HEIGHT, bits);
+        for (int word = 0; word < rowWords; word++)
+        {
+            bits[word] &= occupied[x][word];
+        }
+    }
+
+    // rewrite the record of cell (x, y) in place; false when the cell has
+    // none or no longer needs one, and only a full update() will do. A
+    // merged run is rewritten only when it is this cell alone; the row is
+    // re-merged on the next update
+    bool updateCell(int x, int y)
+    {
+        // a partial update may have packed the old state already
+        if (updating)
+        {
+            return false;
+        }
+        if (x < window.x0 || x >= window.x1 || y < window.y0 || y >= window.y1)
+        {
+            return false;
+        }
+        int record = cellRecord[recordIndex(x, y)];
+        if (record < 0 || isCompressed(x) || !isOccupied(x, y) || colors[x][y] == vec3(0))
+        {
+            return false;
+        }
+        if (mergeRuns && shadedRecords[record].rect.w != 1)
+        {
+            return false;
+        }
+        shadedRecords[record].color = vec4(colors[x][y], 1);
+        records->write(record, &shadedRecords[record], 1);
+        dirty.add(CellRect{x, y, x + 1, y + 1});
+        return true;
+    }
+
+    // bulk initialization: set every cell to generator(x, y) in one pass.
+    // Rows are split between threads and each thread allocates the rows it
+    // writes, so their pages are first touched by (and local to) the writer.
+    // Black cells are left empty. The generator is called directly rather
+    // than through a std::function, so it can be inlined into the loop.
+    template <typename Generator>
+    void fill(const Generator &generator)
+    {
+        unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+        vector<std::thread> workers;
+        for (unsigned int t = 0; t < threads; t++)
+        {
+            workers.emplace_back([this, &generator, t, threads]
+                                 {
+                for (unsigned int x = GRID_WIDTH * t / threads; x < GRID_WIDTH * (t + 1) / threads; x++)
+                {
+                    vector<vec3> rowColors;
+                    vector<uint64_t> rowOccupied(rowWords);
+                    rowColors.reserve(GRID_HEIGHT);
+                    for (unsigned int y = 0; y < GRID_HEIGHT; y++)
+                    {
+                        rowColors.push_back(generator(x, y));
+                    }
+                    simd.occupancy(rowColors.data(), GRID_HEIGHT, rowOccupied.data());
+                    colors[x].swap(rowColors);
+                    occupied[x].swap(rowOccupied);
+                    vector<CellRun>().swap(compressedRows[x]);
+                    changed(x);
+                } });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    void fill(vec3 color)
+    {
+        fill([color](int, int)
+             { return color; });
+    }
+
+    // returns false, leaving the row untouched, when the cell already had
+    // that color
+    bool addQuad(vec2 pos, vec3 col)
+    {
+
+        if (getCell(pos.x, pos.y) == CellState{col, true})
+        {
+            return false;
+        }
+        changed(pos.x);
+        colors[(int)pos.x][(int)pos.y] = col;
+        setOccupied(pos.x, pos.y, true);
+        return true;
+    }
+
+    // return a cell to the empty state; it merges into the empty runs
+    // around it and is dropped from the records on the next update.
+    // Returns false when it was empty already
+    bool remove(vec2 pos)
+    {
+        if (getCell(pos.x, pos.y) == CellState{vec3(0), false})
+        {
+            return false;
+        }
+        changed(pos.x);
+        colors[(int)pos.x][(int)pos.y] = vec3(0);
+        setOccupied(pos.x, pos.y, false);
+        return true;
+    }
+
+    CellState getCell(int x, int y)
+    {
+        touchRow(x);
+        return CellState{colors[x][y], isOccupied(x, y)};
+    }
+
+    void setCell(int x, int y, CellState state)
+    {
+        touchRow(x);
+        changed(x);
+        colors[x][y] = state.color;
+        setOccupied(x, y, state.initialized);
+    }
+
+    bool isOccupied(int x, int y)
+    {
+        return occupied[x][y / 64] >> (y % 64) & 1;
+    }
+
+    void setOccupied(int x, int y, bool initialized)
+    {
+        uint64_t bit = 1ull << (y % 64);
+        occupied[x][y / 64] = initialized ? occupied[x][y / 64] | bit : occupied[x][y / 64] & ~bit;
+    }
+
+    // the runs of an expanded row, written over runs to reuse its capacity
+    static void compressRow(const vector<uint64_t> &rowOccupied, const vector<vec3> &rowColors, vector<CellRun> &runs)
+    {
+        runs.clear();
+        for (size_t y = 0; y < rowColors.size(); y++)
+        {
+            bool initialized = rowOccupied[y / 64] >> (y % 64) & 1;
+            if (!runs.empty() && runs.back().color == rowColors[y] && runs.back().initialized == initialized)
+            {
+                runs.back().length++;
+            }
+            else
+            {
+                runs.push_back(CellRun{rowColors[y], 1, initialized});
+            }
+        }
+    }
+
+    bool isCompressed(int x)
+    {
+        return colors[x].empty();
+    }
+
+    // make row x usable again after it was compressed, and mark it as in use
+    void touchRow(int x)
+    {
+        rowLastUsed[x] = now();
+        if (!isCompressed(x))
+        {
+            return;
+        }
+
+        colors[x].reserve(GRID_HEIGHT);
+        occupied[x].assign(rowWords, 0);
+        for (const CellRun &run : compressedRows[x])
+        {
+            for (int i = 0; i < run.length; i++)
+            {
+                int y = colors[x].size();
+                colors[x].push_back(run.color);
+                setOccupied(x, y, run.initialized);
+            }
+        }
+        // the runs still describe the row
+        rowRuns[x].swap(compressedRows[x]);
+        vector<CellRun>().swap(compressedRows[x]);
+        rowRunsStale[x] = 0;
+    }
+
+    void compressRow(int x)
+    {
+        if (isCompressed(x))
+        {
+            return;
+        }
+        if (rowRunsStale[x])
+        {
+            compressRow(occupied[x], colors[x], compressedRows[x]);
+        }
+        else
+        {
+            compressedRows[x].swap(rowRuns[x]);
+        }
+        compressedRows[x].shrink_to_fit();
+        vector<CellRun>().swap(rowRuns[x]);
+        rowRunsStale[x] = 1;
+        vector<vec3>().swap(colors[x]);
+        vector<uint64_t>().swap(occupied[x]);
+    }
+
+    // compress a few of the rows that are out of view and have not been
+    // touched for COLD_ROW_SECONDS; called once per frame
+    void compressColdRows()
+    {
+        double coldBefore = now() - COLD_ROW_SECONDS;
+        for (unsigned int n = 0; n < COLD_ROWS_PER_FRAME; n++)
+        {
+            int x = coldRowCursor;
+            coldRowCursor = (coldRowCursor + 1) % GRID_WIDTH;
+
+            bool visible = x >= bottomLeft.x && x <= topRight.x;
+            if (!visible && rowLastUsed[x] < coldBefore)
+            {
+                compressRow(x);
+            }
+        }
+    }
+
+    // snapshot files hold the dimensions and then every row as runs:
+    // a run count followed by (r, g, b, length << 1 | initialized)
+    bool saveSnapshot(const char *path)
+    {
+        std::ofstream file(path, std::ios::binary);
+        uint32_t header[3] = {0x53474c47, GRID_WIDTH, GRID_HEIGHT}; // "GLGS"
+        file.write((const char *)header, sizeof(header));
+
+        size_t bytes = sizeof(header);
+        for (int x = 0; x < (int)GRID_WIDTH; x++)
+        {
+            vector<CellRun> runs = compressedRows[x];
+            if (!isCompressed(x))
+            {
+                compressRow(occupied[x], colors[x], runs);
+            }
+            uint32_t count = runs.size();
+            file.write((const char *)&count, sizeof(count));
+            for (const CellRun &run : runs)
+            {
+                uint32_t length = run.length << 1 | run.initialized;
+                file.write((const char *)&run.color[0], 3 * sizeof(float));
+                file.write((const char *)&length, sizeof(length));
+            }
+            bytes += sizeof(count) + runs.size() * (3 * sizeof(float) + sizeof(uint32_t));
+        }
+        if (!file)
+        {
+            cout << "ERROR::SNAPSHOT::WRITE_FAILED\n"
+                 << path << endl;
+            return false;
+        }
+        cout << "saved " << path << " (" << bytes << " bytes)" << endl;
+        return true;
+    }
+
+    // loaded rows stay compressed until they are viewed or edited
+    bool loadSnapshot(const char *path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        uint32_t header[3];
+        if (!file.read((char *)header, sizeof(header)) || header[0] != 0x53474c47 || header[1] != GRID_WIDTH || header[2] != GRID_HEIGHT)
+        {
+            cout << "ERROR::SNAPSHOT::BAD_HEADER\n"
+                 << path << endl;
+            return false;
+        }
+
+        vector<vector<CellRun>> rows(GRID_WIDTH);
+        for (int x = 0; x < (int)GRID_WIDTH; x++)
+        {
+            uint32_t count = 0;
+            size_t cells = 0;
+            // a row has at most one run per cell, so a larger count is corrupt
+            if (!file.read((char *)&count, sizeof(count)) || count > GRID_HEIGHT)
+            {
+                cout << "ERROR::SNAPSHOT::BAD_ROW\n"
+                     << path << endl;
+                return false;
+            }
+            rows[x].resize(count);
+            for (CellRun &run : rows[x])
+            {
+                uint32_t length;
+                file.read((char *)&run.color[0], 3 * sizeof(float));
+                file.read((char *)&length, sizeof(length));
+                run.length = length >> 1;
+                run.initialized = length & 1;
+                cells += run.length;
+            }
+            if (!file || cells != GRID_HEIGHT)
+            {
+                cout << "ERROR::SNAPSHOT::BAD_ROW\n"
+                     << path << endl;
+                return false;
+            }
+        }
+
+        for (int x = 0; x < (int)GRID_WIDTH; x++)
+        {
+            compressedRows[x].swap(rows[x]);
+            vector<vec3>().swap(colors[x]);
+            vector<uint64_t>().swap(occupied[x]);
+            vector<CellRun>().swap(rowRuns[x]);
+            changed(x);
+            rowLastUsed[x] = 0;
+        }
+        return true;
+    }
+
+    void draw()
+    {
+        draw(0, GRID_WIDTH);
+    }
+
+    // draw the records of rows [x0, x1) only, which are contiguous since
+    // records are packed in row order
+    void draw(int x0, int x1)
+    {
+        auto before = [](const CellRecord &record, float x)
+        {
+            return record.rect.x < x;
+        };
+        size_t first = std::lower_bound(shadedRecords.begin(), shadedRecords.end(), (float)x0, before) - shadedRecords.begin();
+        size_t last = std::lower_bound(shadedRecords.begin() + first, shadedRecords.end(), (float)x1, before) - shadedRecords.begin();
+
+        glUseProgram(shader->id);
+
+        // render quad
+        glBindVertexArray(VAO);
+        records->draw(*shader, first, last - first);
+        glBindVertexArray(0);
+    }
+};
+
+// a layer drawn as one quad over a rectangle of the world, such as the whole
+// grid. Its vertex shader maps the unit quad onto the rect uniform (x, y,
+// width, height) and passes the fragment shader the world position and the
+// position within the quad; a layer supplies only its fragment shader, which
+// declares them by including WORLD_QUAD_INPUTS.
+#define WORLD_QUAD_INPUTS                                                           \
+    "in vec2 world;\n"                                                               \
+    "in vec2 quadPos; // 0..1 across the quad\n"                                     \
+    "uniform vec4 rect;\n"                                                           \
+    "// the cell under the fragment, for layers over the whole grid\n"               \
+    "ivec2 gridCell() { return ivec2(clamp(floor(world), vec2(0.0), rect.zw - 1.0)); }\n"
+
+class WorldQuadLayer
+{
+protected:
+    ShaderProgram *shader;
+    unsigned int VAO;
+
+    // compile the layer's program and share the QuadRenderer's unit quad
+    void createQuad(QuadRenderer &quads, const char *fragmentShaderSource)
+    {
+        const char *vertexShaderSource = "#version 330 core\n" CAMERA_BLOCK
+                                         "layout (location = 0) in vec3 aPos;\n"
+                                         "uniform vec4 rect;\n"
+                                         "out vec2 world;\n"
+                                         "out vec2 quadPos;\n"
+                                         "void main()\n"
+                                         "{\n"
+                                         "   quadPos = aPos.xy;\n"
+                                         "   world = rect.xy + aPos.xy * rect.zw;\n"
+                                         "   gl_Position = viewProjection * vec4(world, 0.0, 1.0);\n"
+                                         "}\0";
+        shader = &shaders.get(vertexShaderSource, fragmentShaderSource);
+        VAO = quads.shareQuad();
+    }
+
+    // draw the quad over rect with the layer's program, which must be in use
+    void drawQuad(vec4 rect)
+    {
+        glUniform4f(shader->uniform("rect"), rect.x, rect.y, rect.z, rect.w);
+        glBindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
+    }
+
+    void drawGrid()
+    {
+        drawQuad(vec4(0, 0, GRID_WIDTH, GRID_HEIGHT));
+    }
+};
+
+// changed spans of a CellTexture row closer than this many cells are sent
+// as one, trading a few unchanged texels for fewer glTexSubImage2D calls
+const int CELL_TEXTURE_SPAN_GAP = 2;
+
+// a texture with one texel per cell of the grid, and its copy in memory.
+// Texture row y holds cells (0, y) .. (GRID_WIDTH - 1, y); changes are sent
+// as spans of a row, so an edit uploads about as many bytes as it changed
+// plus at most CELL_TEXTURE_SPAN_GAP cells between it and its neighbors.
+class CellTexture
+{
+    vector<unsigned char> values;
+    size_t elementSize;
+    GLenum format, type;
+
+    // the cells changed since the last upload, as spans [x0, x1) of row y;
+    // lastSpan[y] is the index of the span row y last added to, or -1
+    struct Span
+    {
+        int y, x0, x1;
+    };
+    vector<Span> staleSpans;
+    vector<int> lastSpan;
+
+public:
+    unsigned int texture;
+
+    CellTexture(GLenum internalFormat, GLenum format, GLenum type, size_t elementSize)
+        : elementSize(elementSize), format(format), type(type)
+    {
+        values.resize((size_t)GRID_WIDTH * GRID_HEIGHT * elementSize);
+        staleSpans.reserve(GRID_HEIGHT);
+        lastSpan.assign(GRID_HEIGHT, -1);
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, GRID_WIDTH, GRID_HEIGHT, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    unsigned char *at(int x, int y)
+    {
+        return &values[((size_t)y * GRID_WIDTH + x) * elementSize];
+    }
+
+    // cells were written through at() and must be uploaded; a stroke grows
+    // its row's last span, anything further away starts a new one
+    void changed(const CellRect &cells)
+    {
+        for (int y = cells.y0; y < cells.y1; y++)
+        {
+            int i = lastSpan[y];
+            if (i >= 0 && cells.x0 <= staleSpans[i].x1 + CELL_TEXTURE_SPAN_GAP && cells.x1 + CELL_TEXTURE_SPAN_GAP >= staleSpans[i].x0)
+            {
+                staleSpans[i].x0 = std::min(staleSpans[i].x0, cells.x0);
+                staleSpans[i].x1 = std::max(staleSpans[i].x1, cells.x1);
+            }
+            else
+            {
+                lastSpan[y] = staleSpans.size();
+                staleSpans.push_back(Span{y, cells.x0, cells.x1});
+            }
+        }
+    }
+
+    // send the changed spans to the texture, whole rows in one call
+    void upload()
+    {
+        if (staleSpans.empty())
+        {
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (const Span &span : staleSpans)
+        {
+            lastSpan[span.y] = -1;
+        }
+        std::sort(staleSpans.begin(), staleSpans.end(), [](const Span &a, const Span &b)
+                  { return a.y != b.y ? a.y < b.y : a.x0 < b.x0; });
+        for (size_t i = 0; i < staleSpans.size();)
+        {
+            // spans of a row that overlap or are close go together
+            Span span = staleSpans[i++];
+            while (i < staleSpans.size() && staleSpans[i].y == span.y && staleSpans[i].x0 <= span.x1 + CELL_TEXTURE_SPAN_GAP)
+            {
+                span.x1 = std::max(span.x1, staleSpans[i++].x1);
+            }
+            // and so do consecutive rows changed over the whole width
+            int y1 = span.y + 1;
+            if (span.x0 == 0 && span.x1 == (int)GRID_WIDTH)
+            {
+                while (i < staleSpans.size() && (staleSpans[i].y < y1 || (staleSpans[i].y == y1 && staleSpans[i].x0 == 0 && staleSpans[i].x1 == (int)GRID_WIDTH)))
+                {
+                    y1 = staleSpans[i++].y + 1;
+                }
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, span.x0, span.y, span.x1 - span.x0, y1 - span.y, format, type, at(span.x0, span.y));
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        staleSpans.clear();
+    }
+};
+
+// how a ScalarField stores its values
+enum ScalarFormat
+{
+    SCALAR_FLOAT, // 4 bytes per cell; NaN is an empty cell
+    SCALAR_UINT16 // 2 bytes per cell, 0 to 65534; 65535 is an empty cell
+};
+
+enum Colormap
+{
+    COLORMAP_VIRIDIS,
+    COLORMAP_INFERNO,
+    COLORMAP_COOLWARM,
+    COLORMAP_GRAY,
+    COLORMAP_COUNT
+};
+
+// entries per colormap, interpolated from evenly spaced control points
+const int COLORMAP_SIZE = 256;
+const vec3 COLORMAP_POINTS[COLORMAP_COUNT][5] = {
+    {vec3(0.267f, 0.005f, 0.329f), vec3(0.229f, 0.322f, 0.545f), vec3(0.128f, 0.567f, 0.551f), vec3(0.369f, 0.789f, 0.383f), vec3(0.993f, 0.906f, 0.144f)},
+    {vec3(0.001f, 0.000f, 0.014f), vec3(0.341f, 0.062f, 0.429f), vec3(0.735f, 0.216f, 0.330f), vec3(0.978f, 0.557f, 0.035f), vec3(0.988f, 0.998f, 0.645f)},
+    {vec3(0.230f, 0.299f, 0.754f), vec3(0.552f, 0.690f, 0.996f), vec3(0.866f, 0.866f, 0.866f), vec3(0.958f, 0.604f, 0.482f), vec3(0.706f, 0.016f, 0.150f)},
+    {vec3(0.0f), vec3(0.25f), vec3(0.5f), vec3(0.75f), vec3(1.0f)}};
+
+// a heatmap layer: one scalar per cell, kept in a texture and colored on the
+// GPU through a colormap texture. The range, log scale and colormap are
+// uniforms, so changing them uploads nothing; an edit uploads 2 or 4 bytes
+// per cell. It is drawn as a single quad over the cells, empty cells letting
+// them show through.
+class ScalarField : public WorldQuadLayer
+{
+    unsigned int colormapTexture;
+    CellTexture values;
+
+    void store(int x, int y, float value)
+    {
+        unsigned char *element = values.at(x, y);
+        if (format == SCALAR_FLOAT)
+        {
+            memcpy(element, &value, sizeof(value));
+        }
+        else
+        {
+            uint16_t raw = std::isnan(value) ? 65535 : std::max(0.0f, std::min(65534.0f, std::round(value)));
+            memcpy(element, &raw, sizeof(raw));
+        }
+    }
+
+    void changed(const CellRect &cells)
+    {
+        values.changed(cells);
+        dirty.add(cells);
+    }
+
+public:
+    const ScalarFormat format;
+    float valueMin = 0, valueMax = 1;
+    bool logScale = false;
+    Colormap colormap = COLORMAP_VIRIDIS;
+
+    // cells changed since the scene cache last redrew them, and a count of
+    // changes to how every cell is colored
+    CellRect dirty;
+    unsigned int version = 0;
+
+    ScalarField(QuadRenderer &quads, ScalarFormat format)
+        : values(format == SCALAR_FLOAT ? GL_R32F : GL_R16, GL_RED, format == SCALAR_FLOAT ? GL_FLOAT : GL_UNSIGNED_SHORT,
+                 format == SCALAR_FLOAT ? sizeof(float) : sizeof(uint16_t)),
+          format(format)
+    {
+        for (int y = 0; y < (int)GRID_HEIGHT; y++)
+        {
+            for (int x = 0; x < (int)GRID_WIDTH; x++)
+            {
+                store(x, y, NAN);
+            }
+        }
+        changed(CellRect{0, 0, (int)GRID_WIDTH, (int)GRID_HEIGHT});
+
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n"
+                                           WORLD_QUAD_INPUTS
+                                           "uniform sampler2D values;\n"
+                                           "uniform sampler2D colormaps;\n"
+                                           "uniform int uint16;\n"
+                                           "uniform float valueMin;\n"
+                                           "uniform float valueMax;\n"
+                                           "uniform int logScale;\n"
+                                           "uniform float colormap; // row of colormaps\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   ivec2 cell = gridCell();\n"
+                                           "   float value = texelFetch(values, cell, 0).r;\n"
+                                           "   if (uint16 != 0)\n"
+                                           "   {\n"
+                                           "      value = floor(value * 65535.0 + 0.5);\n"
+                                           "      if (value == 65535.0) discard;\n"
+                                           "   }\n"
+                                           "   else if (isnan(value)) discard;\n"
+                                           "   float t = (value - valueMin) / max(valueMax - valueMin, 1e-20);\n"
+                                           "   if (logScale != 0)\n"
+                                           "   {\n"
+                                           "      t = log(1.0 + max(value - valueMin, 0.0)) / log(1.0 + max(valueMax - valueMin, 1e-20));\n"
+                                           "   }\n"
+                                           "   float u = (clamp(t, 0.0, 1.0) * 255.0 + 0.5) / 256.0; // COLORMAP_SIZE texels\n"
+                                           "   FragColor = vec4(texture(colormaps, vec2(u, colormap)).rgb, 1.0);\n"
+                                           "}\n\0";
+        createQuad(quads, fragmentShaderSource);
+
+        // every colormap is a row of one texture, so switching is a uniform
+        vector<unsigned char> colormaps;
+        for (int map = 0; map < COLORMAP_COUNT; map++)
+        {
+            for (int i = 0; i < COLORMAP_SIZE; i++)
+            {
+                float t = i * 4.0f / (COLORMAP_SIZE - 1);
+                int point = std::min(3, (int)t);
+                vec3 color = COLORMAP_POINTS[map][point] + (COLORMAP_POINTS[map][point + 1] - COLORMAP_POINTS[map][point]) * (t - point);
+                for (int c = 0; c < 3; c++)
+                {
+                    colormaps.push_back(std::round(color[c] * 255.0f));
+                }
+                colormaps.push_back(255);
+            }
+        }
+        glGenTextures(1, &colormapTexture);
+        glBindTexture(GL_TEXTURE_2D, colormapTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, COLORMAP_SIZE, COLORMAP_COUNT, 0, GL_RGBA, GL_UNSIGNED_BYTE, colormaps.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // NaN empties the cell
+    void set(int x, int y, float value)
+    {
+        store(x, y, value);
+        changed(CellRect{x, y, x + 1, y + 1});
+    }
+
+    float get(int x, int y)
+    {
+        const unsigned char *element = values.at(x, y);
+        if (format == SCALAR_FLOAT)
+        {
+            float value;
+            memcpy(&value, element, sizeof(value));
+            return value;
+        }
+        uint16_t raw;
+        memcpy(&raw, element, sizeof(raw));
+        return raw == 65535 ? NAN : raw;
+    }
+
+    // set every cell to generator(x, y)
+    template <typename Generator>
+    void fill(const Generator &generator)
+    {
+        for (int y = 0; y < (int)GRID_HEIGHT; y++)
+        {
+            for (int x = 0; x < (int)GRID_WIDTH; x++)
+            {
+                store(x, y, generator(x, y));
+            }
+        }
+        changed(CellRect{0, 0, (int)GRID_WIDTH, (int)GRID_HEIGHT});
+    }
+
+    // values at or below min take the first color, at or above max the last
+    void setRange(float min, float max)
+    {
+        valueMin = min;
+        valueMax = max;
+        version++;
+    }
+
+    // color by log(1 + value - min) rather than value
+    void setLogScale(bool enabled)
+    {
+        logScale = enabled;
+        version++;
+    }
+
+    void setColormap(Colormap map)
+    {
+        colormap = map;
+        version++;
+    }
+
+    // the values texture, with any changes uploaded
+    unsigned int texture()
+    {
+        values.upload();
+        return values.texture;
+    }
+
+    void draw()
+    {
+        values.upload();
+        glUseProgram(shader->id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, values.texture);
+        glUniform1i(shader->uniform("values"), 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, colormapTexture);
+        glUniform1i(shader->uniform("colormaps"), 1);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(shader->uniform("uint16"), format == SCALAR_UINT16);
+        glUniform1f(shader->uniform("valueMin"), valueMin);
+        glUniform1f(shader->uniform("valueMax"), valueMax);
+        glUniform1i(shader->uniform("logScale"), logScale);
+        glUniform1f(shader->uniform("colormap"), (colormap + 0.5f) / COLORMAP_COUNT);
+
+        drawGrid();
+    }
+};
+
+// how a cell state is animated; time is the shader's, so animating costs
+// no CPU work or uploads however many cells are in the state
+enum StateEffect
+{
+    STATE_STEADY, // color
+    STATE_BLINK,  // color for the first half of each period, then altColor
+    STATE_PULSE   // fades from color to altColor and back over each period
+};
+
+// how the cells in one state are drawn; a transparent color lets the cell
+// beneath show through
+struct StateStyle
+{
+    vec4 color;
+    vec4 altColor = vec4(0);
+    StateEffect effect = STATE_STEADY;
+    float period = 1.0f; // seconds
+    float phase = 0.0f;  // fraction of a period
+};
+
+// the palette has a style for each of these; state 0 is no state
+const int MAX_CELL_STATES = 256;
+
+// time passed to the shader wraps at this many seconds, so that a float still
+// resolves it after days on a wall display; periods that divide it loop
+// seamlessly
+const double STATE_TIME_WRAP = 3600.0;
+
+// a layer of per-cell states (alarm, warning, ...) drawn over everything
+// else. Each cell holds a one-byte state; a palette texture maps states to
+// styles, and the shader animates them from a time uniform.
+class StateLayer : public WorldQuadLayer
+{
+    unsigned int paletteTexture;
+    CellTexture states;
+    StateStyle styles[MAX_CELL_STATES];
+    size_t stateCells[MAX_CELL_STATES] = {}; // how many cells are in each state
+    double startTime = now();
+
+public:
+    StateLayer(QuadRenderer &quads) : states(GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, 1)
+    {
+        stateCells[0] = (size_t)GRID_WIDTH * GRID_HEIGHT;
+        states.changed(CellRect{0, 0, (int)GRID_WIDTH, (int)GRID_HEIGHT});
+
+        // palette column s holds state s: color, altColor, (effect, period, phase)
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n"
+                                           WORLD_QUAD_INPUTS
+                                           "uniform usampler2D states;\n"
+                                           "uniform sampler2D palette;\n"
+                                           "uniform float time;\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   ivec2 cell = gridCell();\n"
+                                           "   int state = int(texelFetch(states, cell, 0).r);\n"
+                                           "   if (state == 0) discard;\n"
+                                           "   vec4 color = texelFetch(palette, ivec2(state, 0), 0);\n"
+                                           "   vec4 altColor = texelFetch(palette, ivec2(state, 1), 0);\n"
+                                           "   vec4 effect = texelFetch(palette, ivec2(state, 2), 0);\n"
+                                           "   float cycle = fract(time / effect.y + effect.z);\n"
+                                           "   if (effect.x == 1.0) color = cycle < 0.5 ? color : altColor;\n"
+                                           "   if (effect.x == 2.0) color = mix(color, altColor, 0.5 - 0.5 * cos(6.2831853 * cycle));\n"
+                                           "   if (color.a == 0.0) discard;\n"
+                                           "   FragColor = color;\n"
+                                           "}\n\0";
+        createQuad(quads, fragmentShaderSource);
+
+        glGenTextures(1, &paletteTexture);
+        glBindTexture(GL_TEXTURE_2D, paletteTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, MAX_CELL_STATES, 3, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        for (int state = 0; state < MAX_CELL_STATES; state++)
+        {
+            setStyle(state, StateStyle{vec4(0)});
+        }
+    }
+
+    // restyle every cell in state; uploads three texels
+    void setStyle(int state, const StateStyle &style)
+    {
+        styles[state] = style;
+        vec4 texels[3] = {style.color, style.altColor, vec4(style.effect, std::max(style.period, 1e-3f), style.phase, 0)};
+        glBindTexture(GL_TEXTURE_2D, paletteTexture);
+        for (int row = 0; row < 3; row++)
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, state, row, 1, 1, GL_RGBA, GL_FLOAT, &texels[row]);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        requestRedraw();
+    }
+
+    const StateStyle &style(int state)
+    {
+        return styles[state];
+    }
+
+    void set(int x, int y, uint8_t state)
+    {
+        uint8_t &cell = *states.at(x, y);
+        stateCells[cell]--;
+        stateCells[state]++;
+        cell = state;
+        states.changed(CellRect{x, y, x + 1, y + 1});
+    }
+
+    uint8_t get(int x, int y)
+    {
+        return *states.at(x, y);
+    }
+
+    // the states texture, with any changes uploaded
+    unsigned int texture()
+    {
+        states.upload();
+        return states.texture;
+    }
+
+    // true while some cell is in a blinking or pulsing state, which needs
+    // frames drawn continuously
+    bool animating()
+    {
+        for (int state = 1; state < MAX_CELL_STATES; state++)
+        {
+            if (stateCells[state] > 0 && styles[state].effect != STATE_STEADY)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void draw()
+    {
+        states.upload();
+        glUseProgram(shader->id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, states.texture);
+        glUniform1i(shader->uniform("states"), 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, paletteTexture);
+        glUniform1i(shader->uniform("palette"), 1);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1f(shader->uniform("time"), std::fmod(now() - startTime, STATE_TIME_WRAP));
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        drawGrid();
+        glDisable(GL_BLEND);
+    }
+};
+
+// a question asked of every cell, answered on the GPU from the values and
+// states already there; a cell matches when it passes every enabled test
+struct CellQuery
+{
+    // valueMin <= value <= valueMax, equal bounds for equality; empty cells
+    // never match
+    bool testValue = false;
+    float valueMin = 0, valueMax = 0;
+
+    // state == state
+    bool testState = false;
+    uint8_t state = 0;
+
+    // (state & mask) == bits, for states used as flags
+    bool testBits = false;
+    uint8_t mask = 0, bits = 0;
+};
+
+enum QueryEffect
+{
+    QUERY_HIGHLIGHT, // color over the cells that match
+    QUERY_DIM        // color over the cells that do not
+};
+
+// draws the answer to a CellQuery over the grid. The query is a handful of
+// uniforms, so asking a new one moves no cell data.
+class QueryLayer : public WorldQuadLayer
+{
+
+public:
+    CellQuery query;
+    QueryEffect effect = QUERY_HIGHLIGHT;
+    vec4 color;
+    bool active = false;
+
+    QueryLayer(QuadRenderer &quads)
+    {
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n"
+                                           WORLD_QUAD_INPUTS
+                                           "uniform sampler2D values;\n"
+                                           "uniform usampler2D states;\n"
+                                           "uniform int uint16;\n"
+                                           "uniform int testValue;\n"
+                                           "uniform float valueMin;\n"
+                                           "uniform float valueMax;\n"
+                                           "uniform int testState;\n"
+                                           "uniform uint state;\n"
+                                           "uniform int testBits;\n"
+                                           "uniform uint mask;\n"
+                                           "uniform uint bits;\n"
+                                           "uniform int dim;\n"
+                                           "uniform vec4 color;\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   ivec2 cell = gridCell();\n"
+                                           "   bool match = true;\n"
+                                           "   if (testValue != 0)\n"
+                                           "   {\n"
+                                           "      float value = texelFetch(values, cell, 0).r;\n"
+                                           "      bool empty = isnan(value);\n"
+                                           "      if (uint16 != 0)\n"
+                                           "      {\n"
+                                           "         value = floor(value * 65535.0 + 0.5);\n"
+                                           "         empty = value == 65535.0;\n"
+                                           "      }\n"
+                                           "      match = !empty && value >= valueMin && value <= valueMax;\n"
+                                           "   }\n"
+                                           "   uint cellState = texelFetch(states, cell, 0).r;\n"
+                                           "   if (testState != 0) match = match && cellState == state;\n"
+                                           "   if (testBits != 0) match = match && (cellState & mask) == bits;\n"
+                                           "   if (match == (dim != 0)) discard;\n"
+                                           "   FragColor = color;\n"
+                                           "}\n\0";
+        createQuad(quads, fragmentShaderSource);
+    }
+
+    // values and states are the textures the query reads, 0 if it tests
+    // neither
+    void draw(unsigned int values, bool uint16, unsigned int states)
+    {
+        glUseProgram(shader->id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, values);
+        glUniform1i(shader->uniform("values"), 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, states);
+        glUniform1i(shader->uniform("states"), 1);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(shader->uniform("uint16"), uint16);
+        glUniform1i(shader->uniform("testValue"), query.testValue);
+        glUniform1f(shader->uniform("valueMin"), query.valueMin);
+        glUniform1f(shader->uniform("valueMax"), query.valueMax);
+        glUniform1i(shader->uniform("testState"), query.testState);
+        glUniform1ui(shader->uniform("state"), query.state);
+        glUniform1i(shader->uniform("testBits"), query.testBits);
+        glUniform1ui(shader->uniform("mask"), query.mask);
+        glUniform1ui(shader->uniform("bits"), query.bits);
+        glUniform1i(shader->uniform("dim"), effect == QUERY_DIM);
+        glUniform4f(shader->uniform("color"), color.x, color.y, color.z, color.w);
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        drawGrid();
+        glDisable(GL_BLEND);
+    }
+};
+
+// out-of-core storage for grids larger than RAM: cell colors live in a file
+// split into TILE_SIZE x TILE_SIZE tiles, each stored contiguously so that a
+// tile is a single pread/pwrite. A color of vec3(0) is an empty cell, so a
+// freshly created (sparse) file is an empty grid.
+class TileStore
+{
+    int fd = -1;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t width;
+        uint32_t height;
+        uint32_t tileSize;
+    };
+
+    off_t tileOffset(unsigned int id)
+    {
+        return sizeof(Header) + (off_t)id * tileBytes;
+    }
+
+public:
+    static const size_t tileCells = TILE_SIZE * TILE_SIZE;
+    static const size_t tileBytes = tileCells * sizeof(vec3);
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int tilesX = 0;
+    unsigned int tilesY = 0;
+
+    ~TileStore()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    // open an existing tile file, or create an empty newWidth x newHeight one
+    bool open(const char *path, unsigned int newWidth = 0, unsigned int newHeight = 0)
+    {
+        Header header;
+        fd = ::open(path, O_RDWR);
+        if (fd >= 0)
+        {
+            if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "GLGT", 4) != 0 || header.tileSize != TILE_SIZE)
+            {
+                cout << "ERROR::TILES::BAD_HEADER\n"
+                     << path << endl;
+                return false;
+            }
+        }
+        else
+        {
+            if (newWidth == 0 || newHeight == 0)
+            {
+                cout << "ERROR::TILES::OPEN_FAILED\n"
+                     << path << endl;
+                return false;
+            }
+            fd = ::open(path, O_RDWR | O_CREAT, 0644);
+            memcpy(header.magic, "GLGT", 4);
+            header.width = newWidth;
+            header.height = newHeight;
+            header.tileSize = TILE_SIZE;
+            off_t size = sizeof(Header) + (off_t)((newWidth + TILE_SIZE - 1) / TILE_SIZE) * ((newHeight + TILE_SIZE - 1) / TILE_SIZE) * tileBytes;
+            if (fd < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || ftruncate(fd, size) != 0)
+            {
+                cout << "ERROR::TILES::CREATE_FAILED\n"
+                     << path << endl;
+                return false;
+            }
+        }
+
+        width = header.width;
+        height = header.height;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        return true;
+    }
+
+    // tiles are indexed [tx][ty] like the cells, cells within a tile [x][y]
+    unsigned int tileId(unsigned int tx, unsigned int ty)
+    {
+        return tx * tilesY + ty;
+    }
+
+    void readTile(unsigned int id, vec3 *colors)
+    {
+        if (pread(fd, colors, tileBytes, tileOffset(id)) != (ssize_t)tileBytes)
+        {
+            std::fill(colors, colors + tileCells, vec3(0));
+        }
+    }
+
+    bool writeTile(unsigned int id, const vec3 *colors)
+    {
+        return pwrite(fd, colors, tileBytes, tileOffset(id)) == (ssize_t)tileBytes;
+    }
+};
+
+struct Tile
+{
+    vector<vec3> colors;   // TileStore::tileCells colors, [x * TILE_SIZE + y]
+    bool dirty = false;    // edited since it was read, written back on eviction
+    bool gpuStale = true;  // loaded or edited since it was last uploaded
+    int gpuSlot = -1;
+    std::list<unsigned int>::iterator lruEntry;
+};
+
+// bounded LRU cache of tiles in front of a TileStore. Reads and write-backs
+// run on I/O threads; all other methods are called from the GL thread and
+// never wait on the disk.
+class TileCache
+{
+    struct Job
+    {
+        unsigned int id;
+        bool write;
+        unsigned int attempts = 0;
+    };
+
+    // failed is set once TILE_WRITE_ATTEMPTS writes have failed; the tile
+    // then stays here, with no job, until it is wanted or evicted again
+    struct WriteBack
+    {
+        unsigned int version;
+        vector<vec3> colors;
+        bool failed = false;
+    };
+
+    std::unordered_map<unsigned int, Tile> tiles;
+    std::list<unsigned int> lru; // most recently used first
+    std::unordered_set<unsigned int> reading;
+    std::unordered_map<unsigned int, vector<std::pair<unsigned int, vec3>>> pendingEdits;
+
+    // shared with the I/O threads
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    vector<std::pair<unsigned int, vector<vec3>>> loaded;
+    // evicted dirty tiles stay here until they are on disk, so a tile that
+    // is wanted again meanwhile is restored from memory rather than re-read
+    std::unordered_map<unsigned int, WriteBack> writeBacks;
+    unsigned int writeVersion = 0;
+    bool stopping = false;
+    vector<std::thread> workers;
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this]
+                      { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                return;
+            }
+            Job job = jobs.front();
+            jobs.pop_front();
+
+            if (job.write)
+            {
+                WriteBack &writeBack = writeBacks[job.id];
+                unsigned int version = writeBack.version;
+                vector<vec3> colors = writeBack.colors;
+                lock.unlock();
+                bool written = store.writeTile(job.id, colors.data());
+                lock.lock();
+                if (!written && ++job.attempts >= TILE_WRITE_ATTEMPTS)
+                {
+                    cout << "ERROR::TILES::WRITE_FAILED\n"
+                         << "tile " << job.id << " after " << job.attempts << " attempts" << endl;
+                    writeBacks[job.id].failed = true;
+                }
+                else if (!written || writeBacks[job.id].version != version)
+                {
+                    // failed, or evicted again while writing: write the latest
+                    jobs.push_back(job);
+                }
+                else
+                {
+                    writeBacks.erase(job.id);
+                }
+            }
+            else
+            {
+                lock.unlock();
+                vector<vec3> colors(TileStore::tileCells);
+                store.readTile(job.id, colors.data());
+                lock.lock();
+                loaded.emplace_back(job.id, std::move(colors));
+                requestRedraw();
+            }
+        }
+    }
+
+    Tile &insert(unsigned int id, vector<vec3> colors)
+    {
+        Tile &tile = tiles[id];
+        tile.colors = std::move(colors);
+        lru.push_front(id);
+        tile.lruEntry = lru.begin();
+
+        auto edits = pendingEdits.find(id);
+        if (edits != pendingEdits.end())
+        {
+            for (auto &edit : edits->second)
+            {
+                tile.colors[edit.first] = edit.second;
+            }
+            tile.dirty = true;
+            pendingEdits.erase(edits);
+        }
+        return tile;
+    }
+
+    void evict(unsigned int id)
+    {
+        Tile &tile = tiles[id];
+        if (tile.dirty)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bool queued = writeBacks.count(id) && !writeBacks[id].failed;
+            writeBacks[id] = WriteBack{++writeVersion, std::move(tile.colors)};
+            if (!queued)
+            {
+                jobs.push_back(Job{id, true});
+                wake.notify_one();
+            }
+        }
+        lru.erase(tile.lruEntry);
+        tiles.erase(id);
+    }
+
+public:
+    TileStore &store;
+    size_t capacity;
+
+    TileCache(TileStore &store, size_t capacity = MAX_RESIDENT_TILES) : store(store), capacity(capacity)
+    {
+        for (unsigned int i = 0; i < TILE_IO_THREADS; i++)
+        {
+            workers.emplace_back(&TileCache::work, this);
+        }
+    }
+
+    // drops outstanding reads and waits for every edit to reach the disk,
+    // including edits to tiles that never arrived
+    ~TileCache()
+    {
+        while (!lru.empty())
+        {
+            evict(lru.back());
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const Job &job)
+                                      { return !job.write; }),
+                       jobs.end());
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        // the write-backs are done, so these read what they wrote
+        vector<vec3> colors(TileStore::tileCells);
+        for (auto &edits : pendingEdits)
+        {
+            store.readTile(edits.first, colors.data());
+            for (auto &edit : edits.second)
+            {
+                colors[edit.first] = edit.second;
+            }
+            if (!store.writeTile(edits.first, colors.data()))
+            {
+                cout << "ERROR::TILES::WRITE_FAILED\n"
+                     << "tile " << edits.first << endl;
+            }
+        }
+    }
+
+    Tile *find(unsigned int id)
+    {
+        auto it = tiles.find(id);
+        return it == tiles.end() ? nullptr : &it->second;
+    }
+
+    // the tiles the view needs, most important first. Resident tiles are
+    // marked as recently used, the rest are queued for loading; queued reads
+    // that are no longer wanted are dropped.
+    void want(const vector<unsigned int> &ids)
+    {
+        vector<unsigned int> toRead;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = jobs.begin(); it != jobs.end();)
+            {
+                if (!it->write)
+                {
+                    reading.erase(it->id);
+                    it = jobs.erase(it);
+                }
+                else
+                {
+                    it++;
+                }
+            }
+
+            for (unsigned int id : ids)
+            {
+                Tile *tile = find(id);
+                if (tile)
+                {
+                    lru.splice(lru.begin(), lru, tile->lruEntry);
+                }
+                else if (writeBacks.count(id))
+                {
+                    insert(id, writeBacks[id].colors).dirty = true;
+                }
+                else if (!reading.count(id))
+                {
+                    toRead.push_back(id);
+                }
+            }
+
+            // reads go ahead of write-backs so the view fills in first
+            for (auto it = toRead.rbegin(); it != toRead.rend(); it++)
+            {
+                jobs.push_front(Job{*it, false});
+                reading.insert(*it);
+            }
+        }
+        wake.notify_all();
+    }
+
+    // take in the tiles the I/O threads have read and evict the least
+    // recently used ones over capacity. Returns the number of new tiles.
+    int poll()
+    {
+        vector<std::pair<unsigned int, vector<vec3>>> arrived;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            arrived.swap(loaded);
+        }
+        for (auto &tile : arrived)
+        {
+            reading.erase(tile.first);
+            if (!find(tile.first))
+            {
+                insert(tile.first, std::move(tile.second));
+            }
+        }
+        while (tiles.size() > capacity)
+        {
+            evict(lru.back());
+        }
+        return arrived.size();
+    }
+
+    // edits to tiles that are not resident are applied when they arrive, or
+    // written through when the cache is destroyed
+    void setCell(unsigned int x, unsigned int y, vec3 color)
+    {
+        unsigned int id = store.tileId(x / TILE_SIZE, y / TILE_SIZE);
+        unsigned int index = (x % TILE_SIZE) * TILE_SIZE + y % TILE_SIZE;
+        Tile *tile = find(id);
+        if (tile)
+        {
+            tile->colors[index] = color;
+            tile->dirty = true;
+            tile->gpuStale = true;
+        }
+        else
+        {
+            pendingEdits[id].emplace_back(index, color);
+        }
+    }
+};
+
+// draws a TileCache: resident tiles are uploaded into a fixed pool of GPU
+// slots, recycled least recently drawn first, and tiles that have not
+// arrived yet are drawn as a single placeholder quad each.
+class TileRenderer
+{
+    QuadRenderer &quads;
+    TileCache &cache;
+
+    unsigned int VAO;
+    CellRecordBuffer *records; // TileStore::tileCells records per slot
+
+    vector<int> slotOwner;             // tile id in each slot, -1 when free
+    vector<unsigned int> slotLastDrawn; // frame number
+    vector<int> slotInstances;
+    unsigned int frame = 0;
+
+    vector<CellRecord> staging;
+    vector<CellRecord> placeholders;
+    uint64_t stagingBits[TileStore::tileCells / 64];
+    vector<uint32_t> stagingIndices = vector<uint32_t>(TileStore::tileCells + COMPACT_SLACK);
+
+    // the last slot holds this frame's placeholder quads
+    const int placeholderSlot = MAX_GPU_TILES;
+
+    bool slotFree(int slot)
+    {
+        if (slotOwner[slot] < 0)
+        {
+            return true;
+        }
+        Tile *owner = cache.find(slotOwner[slot]);
+        return !owner || owner->gpuSlot != slot;
+    }
+
+    int acquireSlot(unsigned int id, Tile &tile)
+    {
+        int best = -1;
+        for (int slot = 0; slot < (int)MAX_GPU_TILES; slot++)
+        {
+            if (slotFree(slot))
+            {
+                best = slot;
+                break;
+            }
+            if (slotLastDrawn[slot] != frame && (best < 0 || slotLastDrawn[slot] < slotLastDrawn[best]))
+            {
+                best = slot;
+            }
+        }
+        if (best < 0)
+        {
+            return -1;
+        }
+        if (!slotFree(best))
+        {
+            cache.find(slotOwner[best])->gpuSlot = -1;
+        }
+        slotOwner[best] = id;
+        tile.gpuSlot = best;
+        tile.gpuStale = true;
+        return best;
+    }
+
+    void upload(int slot, unsigned int tx, unsigned int ty, Tile &tile)
+    {
+        // only send initialized cells to the GPU
+        simd.occupancy(tile.colors.data(), TileStore::tileCells, stagingBits);
+        size_t count = simd.compact(stagingBits, TileStore::tileCells, stagingIndices.data());
+        staging.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t cell = stagingIndices[i];
+            staging[i] = CellRecord{vec4(tx * TILE_SIZE + cell / TILE_SIZE, ty * TILE_SIZE + cell % TILE_SIZE, 1, 1), vec4(tile.colors[cell], 1)};
+        }
+        write(slot, staging);
+        tile.gpuStale = false;
+    }
+
+    void write(int slot, const vector<CellRecord> &slotRecords)
+    {
+        slotInstances[slot] = slotRecords.size();
+        records->write(slot * TileStore::tileCells, slotRecords.data(), slotRecords.size());
+    }
+
+    void drawSlot(int slot)
+    {
+        if (slotInstances[slot] == 0)
+        {
+            return;
+        }
+        records->draw(*quads.shader, slot * TileStore::tileCells, slotInstances[slot]);
+    }
+
+public:
+    TileRenderer(QuadRenderer &quads, TileCache &cache) : quads(quads), cache(cache)
+    {
+        slotOwner.assign(MAX_GPU_TILES, -1);
+        slotLastDrawn.assign(MAX_GPU_TILES, 0);
+        slotInstances.assign(MAX_GPU_TILES + 1, 0);
+
+        records = new CellRecordBuffer((MAX_GPU_TILES + 1) * TileStore::tileCells);
+        VAO = quads.shareQuad();
+    }
+
+    // draw the tiles in [tx0, tx1] x [ty0, ty1]
+    void draw(unsigned int tx0, unsigned int ty0, unsigned int tx1, unsigned int ty1)
+    {
+        frame++;
+        glUseProgram(quads.shader->id);
+        glBindVertexArray(VAO);
+
+        placeholders.clear();
+        unsigned int uploads = 0;
+
+        for (unsigned int tx = tx0; tx <= tx1; tx++)
+        {
+            for (unsigned int ty = ty0; ty <= ty1; ty++)
+            {
+                unsigned int id = cache.store.tileId(tx, ty);
+                Tile *tile = cache.find(id);
+                int slot = tile ? tile->gpuSlot : -1;
+
+                if (tile && tile->gpuStale && uploads < MAX_TILE_UPLOADS)
+                {
+                    if (slot < 0)
+                    {
+                        slot = acquireSlot(id, *tile);
+                    }
+                    if (slot >= 0)
+                    {
+                        upload(slot, tx, ty, *tile);
+                        uploads++;
+                    }
+                }
+                else if (tile && tile->gpuStale)
+                {
+                    // over this frame's upload limit; the next frame takes it
+                    requestRedraw();
+                }
+
+                if (slot >= 0)
+                {
+                    slotLastDrawn[slot] = frame;
+                    drawSlot(slot);
+                }
+                else if (placeholders.size() < TileStore::tileCells)
+                {
+                    // not loaded (or uploaded) yet
+                    float w = std::min(TILE_SIZE, cache.store.width - tx * TILE_SIZE);
+                    float h = std::min(TILE_SIZE, cache.store.height - ty * TILE_SIZE);
+                    placeholders.push_back(CellRecord{vec4(tx * TILE_SIZE, ty * TILE_SIZE, w, h), vec4(TILE_PLACEHOLDER_COLOR, 1)});
+                }
+            }
+        }
+
+        write(placeholderSlot, placeholders);
+        drawSlot(placeholderSlot);
+        glBindVertexArray(0);
+    }
+};
+
+// a run of consecutive cells in one row that all went from the same old
+// state to the same new state
+struct EditRun
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t length;
+    CellState before;
+    CellState after;
+};
+
+// one undoable operation, e.g. a mouse stroke or a fill
+struct Edit
+{
+    vector<EditRun> runs;
+};
+
+// undo/redo history of cell edits. Edits between begin() and end() form one
+// operation; edits recorded outside are an operation each. The history is
+// capped at capacity bytes by forgetting the oldest operations.
+class Journal
+{
+    std::deque<Edit> undoStack; // oldest first
+    vector<Edit> redoStack;
+    Edit current;
+    int depth = 0;
+    size_t bytes = 0;
+
+    static size_t size(const Edit &edit)
+    {
+        return sizeof(Edit) + edit.runs.size() * sizeof(EditRun);
+    }
+
+    void commit()
+    {
+        if (current.runs.empty())
+        {
+            return;
+        }
+        current.runs.shrink_to_fit();
+        bytes += size(current);
+        undoStack.push_back(std::move(current));
+        current = Edit();
+        redoStack.clear();
+
+        // always keep the newest operation, however large
+        while (bytes > capacity && undoStack.size() > 1)
+        {
+            bytes -= size(undoStack.front());
+            undoStack.pop_front();
+        }
+    }
+
+public:
+    size_t capacity;
+
+    Journal(size_t capacity = JOURNAL_BYTES) : capacity(capacity)
+    {
+    }
+
+    void begin()
+    {
+        depth++;
+    }
+
+    void end()
+    {
+        if (depth > 0 && --depth == 0)
+        {
+            commit();
+        }
+    }
+
+    void record(uint32_t x, uint32_t y, CellState before, CellState after)
+    {
+        if (before == after)
+        {
+            return;
+        }
+        // extend the last run when this cell continues it, e.g. along a fill
+        if (!current.runs.empty())
+        {
+            EditRun &last = current.runs.back();
+            if (last.x == x && last.y + last.length == y && last.before == before && last.after == after)
+            {
+                last.length++;
+                return;
+            }
+        }
+        current.runs.push_back(EditRun{x, y, 1, before, after});
+        if (depth == 0)
+        {
+            commit();
+        }
+    }
+
+    // the operation to revert, which moves onto the redo stack
+    const Edit *undo()
+    {
+        if (undoStack.empty() || depth > 0)
+        {
+            return nullptr;
+        }
+        bytes -= size(undoStack.back());
+        redoStack.push_back(std::move(undoStack.back()));
+        undoStack.pop_back();
+        return &redoStack.back();
+    }
+
+    // the operation to reapply, which moves back onto the undo stack
+    const Edit *redo()
+    {
+        if (redoStack.empty() || depth > 0)
+        {
+            return nullptr;
+        }
+        bytes += size(redoStack.back());
+        undoStack.push_back(std::move(redoStack.back()));
+        redoStack.pop_back();
+        return &undoStack.back();
+    }
+
+    void clear()
+    {
+        undoStack.clear();
+        redoStack.clear();
+        current = Edit();
+        bytes = 0;
+    }
+};
+
+vec3 selectedColor = vec3(0, 1, 0);
+bool leftMouseButtonPressed = false;
+bool rightMouseButtonPressed = false;
+
+// how a requested cell update is run
+enum UpdatePolicy
+{
+    UPDATE_REAL_TIME, // packed and uploaded in the frame it was requested
+    UPDATE_AMORTIZED, // packed in the background, uploaded in a later frame
+    UPDATE_DEFERRED   // amortized, once the view stops changing
+};
+
+// chooses an UpdatePolicy for each update from the measured cost per row of
+// earlier ones, so that frames stay within frameBudget whatever the machine,
+// grid or zoom level
+class UpdateScheduler
+{
+    QuadRenderer &cells;
+    bool requested = false;
+    double lastRequest = 0;
+    double secondsPerRow = 0; // running average, 0 until measured
+    double mainSeconds = 0;   // spent on the update in flight by this thread
+
+    void begin()
+    {
+        double start = now();
+        requested = false;
+        cells.beginUpdate();
+        mainSeconds = now() - start;
+    }
+
+    // the cost of an update is its packing plus what it took on this thread
+    void finish()
+    {
+        double start = now();
+        cells.finishUpdate();
+        mainSeconds += now() - start;
+        requestRedraw();
+        if (cells.updateRows > 0)
+        {
+            double sample = (mainSeconds + cells.packer->packSeconds) / cells.updateRows;
+            secondsPerRow = secondsPerRow == 0 ? sample : secondsPerRow * 0.8 + sample * 0.2;
+        }
+    }
+
+public:
+    UpdatePolicy policy = UPDATE_REAL_TIME;
+
+    UpdateScheduler(QuadRenderer &cells) : cells(cells)
+    {
+    }
+
+    void request()
+    {
+        requested = true;
+        lastRequest = now();
+    }
+
+    // called once per frame with the time the last frame spent drawing
+    void run(double drawSeconds)
+    {
+        if (cells.updating)
+        {
+            if (!cells.updateReady())
+            {
+                return;
+            }
+            finish();
+        }
+        if (!requested)
+        {
+            return;
+        }
+
+        double available = std::max(frameBudget - drawSeconds, frameBudget * 0.25);
+        CellRect window = cells.packWindow();
+        int rows = window.x1 - window.x0;
+        double predicted = rows * secondsPerRow;
+        policy = predicted <= available                     ? UPDATE_REAL_TIME
+                 : predicted <= available * UPDATE_MAX_FRAMES ? UPDATE_AMORTIZED
+                                                              : UPDATE_DEFERRED;
+        if (policy == UPDATE_DEFERRED && now() - lastRequest < UPDATE_SETTLE_SECONDS)
+        {
+            return;
+        }
+
+        begin();
+        if (policy == UPDATE_REAL_TIME)
+        {
+            cells.waitUpdate();
+            finish();
+        }
+    }
+
+    // an update is requested or in flight, so more frames are needed
+    bool pending()
+    {
+        return requested || cells.updating;
+    }
+
+    // complete any requested or partial update now
+    void flush()
+    {
+        if (cells.updating)
+        {
+            cells.waitUpdate();
+            finish();
+        }
+        if (requested)
+        {
+            begin();
+            cells.waitUpdate();
+            finish();
+        }
+    }
+};
+
+// an offscreen image of the cells and lines over the cells the records
+// cover. While they are unchanged, a frame only draws the image as one quad
+// through the current camera, so pans and zooms within it cost no cell
+// drawing; edits redraw only the rows they touched.
+class SceneCache : public WorldQuadLayer
+{
+    unsigned int framebuffer, texture;
+    int width, height; // texels
+
+    CellRect area; // the cells the image covers, empty until first rendered
+    LatticeView lattice; // the lattice lines for area
+    unsigned int linesVersion = 0;
+    unsigned int scalarsVersion = 0;
+
+    // one cell of border, so lines on the edge of the grid are not cut in half
+    vec4 worldRect()
+    {
+        return vec4(area.x0 - 1, area.y0 - 1, area.x1 - area.x0 + 2, area.y1 - area.y0 + 2);
+    }
+
+    // redraw region (clipped to the image) with the cells and lines as they
+    // are now
+    void render(QuadRenderer &cells, ScalarField *scalars, LineRenderer &lines, CameraUniforms &camera, CellRect region, bool full)
+    {
+        vec4 rect = worldRect();
+        vec2 texelsPerCell = vec2(width, height) / vec2(rect.z, rect.w);
+
+        int viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        camera.set(ortho(rect.x, rect.x + rect.z, rect.y, rect.y + rect.w, -1.0f, 1.0f), vec2(width, height));
+
+        if (!full)
+        {
+            // widened by a cell for lines, which spill over cell edges
+            int x0 = std::max(0.0f, std::floor((region.x0 - 1 - rect.x) * texelsPerCell.x));
+            int y0 = std::max(0.0f, std::floor((region.y0 - 1 - rect.y) * texelsPerCell.y));
+            int x1 = std::min((float)width, std::ceil((region.x1 + 1 - rect.x) * texelsPerCell.x));
+            int y1 = std::min((float)height, std::ceil((region.y1 + 1 - rect.y) * texelsPerCell.y));
+            glEnable(GL_SCISSOR_TEST);
+            glScissor(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+        }
+        glClear(GL_COLOR_BUFFER_BIT);
+        cells.draw(full ? area.x0 : region.x0 - 1, full ? area.x1 : region.x1 + 1);
+        if (scalars)
+        {
+            scalars->draw();
+            scalarsVersion = scalars->version;
+        }
+        if (full)
+        {
+            lines.setView(lattice, vec2(area.x0, area.y0), vec2(area.x1 - 1, area.y1 - 1), texelsPerCell.x);
+        }
+        lines.draw(lattice);
+        glDisable(GL_SCISSOR_TEST);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        camera.set(projection * view);
+        linesVersion = lines.version;
+    }
+
+public:
+    bool complete = false;
+
+    SceneCache(QuadRenderer &quads, LineRenderer &lines)
+    {
+        lines.initView(lattice);
+        width = SCR_WIDTH * (1 + 2 * SCENE_CACHE_MARGIN);
+        height = SCR_HEIGHT * (1 + 2 * SCENE_CACHE_MARGIN);
+
+        const char *fragmentShaderSource = "#version 330 core\n"
+                                           "out vec4 FragColor;\n" WORLD_QUAD_INPUTS
+                                           "uniform sampler2D scene;\n"
+                                           "void main()\n"
+                                           "{\n"
+                                           "   FragColor = texture(scene, quadPos);\n"
+                                           "}\n\0";
+        createQuad(quads, fragmentShaderSource);
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!complete)
+        {
+            cout << "ERROR::SCENE_CACHE::INCOMPLETE_FRAMEBUFFER\n"
+                 << width << "x" << height << endl;
+        }
+    }
+
+    // true while the image still shows the view at about screen resolution
+    bool covers(QuadRenderer &cells)
+    {
+        CellRect view;
+        view.x0 = std::max(0.0f, cells.bottomLeft.x);
+        view.y0 = std::max(0.0f, cells.bottomLeft.y);
+        view.x1 = std::min((float)GRID_WIDTH, cells.topRight.x + 1);
+        view.y1 = std::min((float)GRID_HEIGHT, cells.topRight.y + 1);
+        float zoom = cells.pixelsPerCell() / std::max(1e-6f, cells.windowPixelsPerCell);
+        if (zoom > SCENE_CACHE_MAX_ZOOM || zoom < 1.0f / SCENE_CACHE_MAX_ZOOM)
+        {
+            return false;
+        }
+        return view.empty() || (view.x0 >= cells.window.x0 && view.y0 >= cells.window.y0 && view.x1 <= cells.window.x1 && view.y1 <= cells.window.y1);
+    }
+
+    // bring the image up to date and draw it
+    void draw(QuadRenderer &cells, ScalarField *scalars, LineRenderer &lines, CameraUniforms &camera)
+    {
+        CellRect dirty = cells.dirty;
+        if (scalars)
+        {
+            dirty.add(scalars->dirty);
+            scalars->dirty = CellRect();
+        }
+        cells.dirty = CellRect();
+
+        if (!(cells.window == area) || lines.version != linesVersion || (scalars && scalars->version != scalarsVersion))
+        {
+            area = cells.window;
+            if (!area.empty())
+            {
+                render(cells, scalars, lines, camera, area, true);
+            }
+        }
+        else if (!dirty.empty())
+        {
+            render(cells, scalars, lines, camera, dirty, false);
+        }
+        if (area.empty())
+        {
+            return;
+        }
+
+        glUseProgram(shader->id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glUniform1i(shader->uniform("scene"), 0);
+        drawQuad(worldRect());
+    }
+};
+
+class Grid
+{
+public:
+    CameraUniforms camera;
+    LineRenderer lines;
+    QuadRenderer cells;
+    Journal journal; // in-memory grids only
+    UpdateScheduler updates;
+
+    unsigned int width = GRID_WIDTH;
+    unsigned int height = GRID_HEIGHT;
+
+    // set when the grid is streamed from a tile file rather than held in memory
+    TileStore *store = nullptr;
+    TileCache *tiles = nullptr;
+    TileRenderer *tileRenderer = nullptr;
+
+    // in-memory grids only; null if disabled or unsupported
+    SceneCache *cache = nullptr;
+
+    // the heatmap layer, in-memory grids only; null until enableScalars()
+    ScalarField *scalars = nullptr;
+
+    // alarm and highlight states over everything, in-memory grids only; null
+    // until enableStates()
+    StateLayer *states = nullptr;
+
+    // highlights the cells matching a query; null until the first setQuery()
+    QueryLayer *query = nullptr;
+
+    // a streamed grid has no dense cells; its QuadRenderer only tracks the view
+    Grid(TileStore *tileStore = nullptr) : cells(!tileStore), updates(cells), store(tileStore)
+    {
+
+        if (store)
+        {
+            width = store->width;
+            height = store->height;
+            tiles = new TileCache(*store);
+            tileRenderer = new TileRenderer(cells, *tiles);
+        }
+        else if (useSceneCache)
+        {
+            cache = new SceneCache(cells, lines);
+            if (!cache->complete)
+            {
+                delete cache;
+                cache = nullptr;
+            }
+        }
+        // the cache needs cells packed beyond the view to pan into
+        cells.viewMargin = cache ? SCENE_CACHE_MARGIN : 0;
+
+        // the grid lines are generated for the visible part of the grid as it is drawn
+        lines.setLattice(width, height);
+    }
+
+    ~Grid()
+    {
+        delete query;
+        delete states;
+        delete scalars;
+        delete cache;
+        delete tileRenderer;
+        delete tiles;
+        delete store;
+    }
+
+    void addCell(vec2 gridPos, vec3 color, bool updateImmediately = true)
+    {
+
+        // ignore mouse clicks outside the grid
+        if (gridPos.x < 0 || gridPos.x > (width - 1) || gridPos.y < 0 || gridPos.y > (height - 1))
+        {
+            return;
+        }
+        if (tiles)
+        {
+            tiles->setCell(gridPos.x, gridPos.y, color);
+            if (updateImmediately)
+            {
+                requestRedraw();
+            }
+            return;
+        }
+        CellState before = cells.getCell(gridPos.x, gridPos.y);
+        if (!cells.addQuad(gridPos, color))
+        {
+            return;
+        }
+        journal.record(gridPos.x, gridPos.y, before, cells.getCell(gridPos.x, gridPos.y));
+        if (!updateImmediately)
+        {
+            return;
+        }
+        if (cells.updateCell(gridPos.x, gridPos.y))
+        {
+            requestRedraw();
+        }
+        else
+        {
+            update();
+        }
+    }
+
+    void removeCell(vec2 gridPos, bool updateImmediately = true)
+    {
+
+        // ignore mouse clicks outside the grid
+        if (gridPos.x < 0 || gridPos.x > (width - 1) || gridPos.y < 0 || gridPos.y > (height - 1))
+        {
+            return;
+        }
+        if (tiles)
+        {
+            // tiles store empty cells as black, which is never drawn
+            tiles->setCell(gridPos.x, gridPos.y, vec3(0));
+            if (updateImmediately)
+            {
+                requestRedraw();
+            }
+            return;
+        }
+        CellState before = cells.getCell(gridPos.x, gridPos.y);
+        if (!cells.remove(gridPos))
+        {
+            return;
+        }
+        journal.record(gridPos.x, gridPos.y, before, cells.getCell(gridPos.x, gridPos.y));
+        if (!updateImmediately)
+        {
+            return;
+        }
+        if (cells.updateCell(gridPos.x, gridPos.y))
+        {
+            requestRedraw();
+        }
+        else
+        {
+            update();
+        }
     }
 
-    void calculateFrustum()
+    // set every cell in [bottomLeft, topRight] as a single undoable operation
+    void fill(vec2 bottomLeft, vec2 topRight, vec3 color)
     {
-        vec3 rayWorld = rayCast(0, SCR_HEIGHT, projection, view);
-        vec3 worldPos = rayPlaneIntersection(cameraPos, rayWorld, vec3(0, 0, 1), vec3(0, 0, 0));
-        bottomLeft = vec2((int)worldPos.x, (int)worldPos.y);
-
-        rayWorld = rayCast(SCR_WIDTH, 0, projection, view);
-        worldPos = rayPlaneIntersection(cameraPos, rayWorld, vec3(0, 0, 1), vec3(0, 0, 0));
-        topRight = vec2((int)worldPos.x, (int)worldPos.y);
+        journal.begin();
+        for (int i = std::max(0.0f, bottomLeft.x); i <= std::min(width - 1.0f, topRight.x); i++)
+        {
+            for (int j = std::max(0.0f, bottomLeft.y); j <= std::min(height - 1.0f, topRight.y); j++)
+            {
+                addCell(vec2(i, j), color, false);
+            }
+        }
+        journal.end();
+        update();
     }
 
-    // send updated data to GPU
-    void update()
+    // replay an operation's runs with one batched update at the end
+    void replay(const Edit *edit, bool undo)
     {
-        _models = flatten(models, bottomLeft, topRight);
-        _colors = flatten(colors, bottomLeft, topRight);
-
-        vector<mat4> shadedCellModels = {};
-        vector<vec3> shadedCellColors = {};
-
-        for (int i = 0; i < _models.size(); i++)
+        if (!edit)
+        {
+            return;
+        }
+        for (size_t r = 0; r < edit->runs.size(); r++)
         {
-            // only send initialized cells to the GPU
-            if (_models[i] != mat4(0) && _colors[i] != vec3(0))
+            // undo walks the runs backwards so overlapping edits unwind in order
+            const EditRun &run = edit->runs[undo ? edit->runs.size() - 1 - r : r];
+            for (uint32_t y = run.y; y < run.y + run.length; y++)
             {
-                shadedCellModels.push_back(_models[i]);
-                shadedCellColors.push_back(_colors[i]);
+                cells.setCell(run.x, y, undo ? run.before : run.after);
             }
         }
+        update();
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, matrixBuffer);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, shadedCellModels.size() * sizeof(mat4), &shadedCellModels.front());
-
-        glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, shadedCellColors.size() * sizeof(vec3), &shadedCellColors.front());
+    void undo()
+    {
+        replay(journal.undo(), true);
     }
 
-    void addQuad(vec2 pos, vec3 col)
+    void redo()
     {
+        replay(journal.redo(), false);
+    }
 
-        mat4 model = translate(mat4(1.0), vec3(pos, 0.0));
-        models[(int)pos.x][(int)pos.y] = model;
-        colors[(int)pos.x][(int)pos.y] = col;
+    // snapshots are for in-memory grids; streamed grids live in their tile file
+    void saveSnapshot(const char *path)
+    {
+        if (!tiles)
+        {
+            cells.saveSnapshot(path);
+        }
     }
 
-    void remove(vec2 pos)
+    void loadSnapshot(const char *path)
     {
-        // change color to white
-        colors[(int)pos.x][(int)pos.y] = vec3(1);
+        if (!tiles && cells.loadSnapshot(path))
+        {
+            update();
+        }
     }
 
-    void setCamera(mat4 cameraMatrix)
+    // have the cells in view sent to the GPU as the frame budget allows
+    // (streamed tiles upload themselves as they are drawn)
+    void update()
     {
-        viewProjection = cameraMatrix;
+        requestRedraw();
+        if (!tiles)
+        {
+            updates.request();
+        }
     }
 
-    void draw()
+    // add a heatmap layer over the cells, storing values in format
+    bool enableScalars(ScalarFormat format)
     {
+        if (tiles)
+        {
+            cout << "ERROR::SCALARS::TILED_GRID\n"
+                 << "heatmaps need an in-memory grid" << endl;
+            return false;
+        }
+        delete scalars;
+        scalars = new ScalarField(cells, format);
+        requestRedraw();
+        return true;
+    }
 
-        glUseProgram(shaderProgram);
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "viewProjection"), 1, GL_FALSE, &viewProjection[0][0]);
+    // NaN empties the cell, showing the cell layer beneath
+    void setScalar(vec2 gridPos, float value)
+    {
+        if (!scalars || gridPos.x < 0 || gridPos.x > (width - 1) || gridPos.y < 0 || gridPos.y > (height - 1))
+        {
+            return;
+        }
+        scalars->set(gridPos.x, gridPos.y, value);
+        requestRedraw();
+    }
 
-        // render quad
-        glBindVertexArray(VAO);
-        glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, _models.size());
-        glBindVertexArray(0);
+    // add a layer of per-cell states, each drawn with a style from its palette
+    bool enableStates()
+    {
+        if (tiles)
+        {
+            cout << "ERROR::STATES::TILED_GRID\n"
+                 << "cell states need an in-memory grid" << endl;
+            return false;
+        }
+        delete states;
+        states = new StateLayer(cells);
+        requestRedraw();
+        return true;
     }
-};
 
-vec3 selectedColor = vec3(0, 1, 0);
-bool leftMouseButtonPressed = false;
-bool rightMouseButtonPressed = false;
+    // state 0 clears the cell's state
+    void setState(vec2 gridPos, uint8_t state)
+    {
+        if (!states || gridPos.x < 0 || gridPos.x > (width - 1) || gridPos.y < 0 || gridPos.y > (height - 1))
+        {
+            return;
+        }
+        states->set(gridPos.x, gridPos.y, state);
+        requestRedraw();
+    }
 
-class Grid
-{
-public:
-    LineRenderer lines;
-    QuadRenderer cells;
+    // draw color over the cells that match q (or, dimming, those that do
+    // not) until clearQuery(); testing values needs the heatmap layer and
+    // testing states the state layer
+    bool setQuery(const CellQuery &q, QueryEffect effect, vec4 color)
+    {
+        if (q.testValue && !scalars)
+        {
+            cout << "ERROR::QUERY::NO_SCALARS\n"
+                 << "testing values needs enableScalars()" << endl;
+            return false;
+        }
+        if ((q.testState || q.testBits) && !states)
+        {
+            cout << "ERROR::QUERY::NO_STATES\n"
+                 << "testing states needs enableStates()" << endl;
+            return false;
+        }
+        if (!query)
+        {
+            query = new QueryLayer(cells);
+        }
+        query->query = q;
+        query->effect = effect;
+        query->color = color;
+        query->active = true;
+        requestRedraw();
+        return true;
+    }
 
-    Grid()
+    void clearQuery()
     {
+        if (query)
+        {
+            query->active = false;
+        }
+        requestRedraw();
+    }
 
-        // glLineWidth(2);
+    // true while cells blink or pulse, so every frame differs
+    bool animating()
+    {
+        return states && states->animating();
+    }
 
-        // draw horizontal lines of grid
-        for (int j = 0; j <= GRID_HEIGHT; j++)
+    // the camera moved: cells are repacked unless the cached scene still
+    // covers the view
+    void viewChanged()
+    {
+        if (cache && cache->covers(cells))
         {
-            lines.addLine(vec3(0, j, 0), vec3(GRID_WIDTH, j, 0));
+            requestRedraw();
+            return;
         }
-        // draw vertical lines of grid
-        for (int i = 0; i <= GRID_WIDTH; i++)
-        {
-            lines.addLine(vec3(i, 0, 0), vec3(i, GRID_HEIGHT, 0));
-        };
+        update();
     }
 
-    void addCell(vec2 gridPos, vec3 color, bool updateImmediately = true)
+    // load the tiles around the view window and draw those inside it
+    void drawTiles()
     {
+        int tx0 = std::max(0, (int)std::floor(cells.bottomLeft.x / TILE_SIZE));
+        int ty0 = std::max(0, (int)std::floor(cells.bottomLeft.y / TILE_SIZE));
+        int tx1 = std::min((int)store->tilesX - 1, (int)std::floor(cells.topRight.x / TILE_SIZE));
+        int ty1 = std::min((int)store->tilesY - 1, (int)std::floor(cells.topRight.y / TILE_SIZE));
 
-        // ignore mouse clicks outside the grid
-        if (gridPos.x < 0 || gridPos.x > (GRID_WIDTH - 1) || gridPos.y < 0 || gridPos.y > (GRID_HEIGHT - 1))
+        // request the visible tiles nearest the center first, then a one
+        // tile margin so that panning finds its tiles already loaded
+        vec2 center = vec2(tx0 + tx1, ty0 + ty1) * 0.5f;
+        vector<unsigned int> wanted;
+        for (int ring = 0; ring <= 1; ring++)
         {
-            return;
+            vector<std::pair<float, unsigned int>> byDistance;
+            for (int tx = tx0 - ring; tx <= tx1 + ring; tx++)
+            {
+                for (int ty = ty0 - ring; ty <= ty1 + ring; ty++)
+                {
+                    bool inside = tx >= tx0 && tx <= tx1 && ty >= ty0 && ty <= ty1;
+                    if (tx < 0 || ty < 0 || tx >= (int)store->tilesX || ty >= (int)store->tilesY || (ring > 0 && inside))
+                    {
+                        continue;
+                    }
+                    vec2 d = vec2(tx, ty) - center;
+                    byDistance.emplace_back(dot(d, d), store->tileId(tx, ty));
+                }
+            }
+            std::sort(byDistance.begin(), byDistance.end());
+            for (auto &tile : byDistance)
+            {
+                wanted.push_back(tile.second);
+            }
+        }
+        // never ask for more than fits, or the cache would evict what it loads
+        if (wanted.size() > std::min(tiles->capacity, (size_t)MAX_GPU_TILES))
+        {
+            wanted.resize(std::min(tiles->capacity, (size_t)MAX_GPU_TILES));
         }
-        cells.addQuad(gridPos, color);
-        if (updateImmediately)
+        tiles->want(wanted);
+        tiles->poll();
+
+        if (tx0 <= tx1 && ty0 <= ty1)
         {
-            cells.update();
+            tileRenderer->draw(tx0, ty0, tx1, ty1);
         }
     }
 
-    void removeCell(vec2 gridPos, bool updateImmediately = true)
+    void draw()
     {
 
-        // ignore mouse clicks outside the grid
-        if (gridPos.x < 0 || gridPos.x > (GRID_WIDTH - 1) || gridPos.y < 0 || gridPos.y > (GRID_HEIGHT - 1))
+        if (cache)
         {
-            return;
+            cache->draw(cells, scalars, lines, camera);
+        }
+        else
+        {
+            if (tiles)
+            {
+                drawTiles();
+            }
+            else
+            {
+                cells.draw();
+            }
+            if (scalars)
+            {
+                scalars->draw();
+            }
+            lines.setView(cells.bottomLeft, cells.topRight, cells.pixelsPerCell());
+            lines.draw();
+        }
+        // animated, so never cached
+        if (states)
+        {
+            states->draw();
         }
-        cells.remove(gridPos);
-        if (updateImmediately)
+        // drawn over the cache so that a new query redraws nothing beneath
+        if (query && query->active)
         {
-            cells.update();
+            query->draw(query->query.testValue ? scalars->texture() : 0, scalars && scalars->format == SCALAR_UINT16,
+                        query->query.testState || query->query.testBits ? states->texture() : 0);
         }
     }
+};
 
-    void draw()
+Grid *grid;
+
+// time spent in each phase from launch to the first frame
+struct StartupTimer
+{
+    double start = now();
+    double last = start;
+    vector<std::pair<const char *, double>> phases;
+    bool reported = false;
+
+    void mark(const char *phase)
     {
+        double t = now();
+        phases.emplace_back(phase, t - last);
+        last = t;
+    }
 
-        cells.draw();
-        lines.draw();
+    void report()
+    {
+        cout << "startup:";
+        for (auto &phase : phases)
+        {
+            cout << " " << phase.first << " " << phase.second * 1000.0 << " ms,";
+        }
+        cout << " total " << (last - start) * 1000.0 << " ms" << endl;
+        reported = true;
     }
 };
 
-Grid *grid;
+// heap allocations per frame, averaged and printed once a second (grid --allocations)
+#ifdef GRID_COUNT_ALLOCATIONS
+struct AllocationReport
+{
+    size_t frames = 0, count = 0, bytes = 0, worst = 0;
+    size_t frameCount = 0, frameBytes = 0;
+    double last = now();
+
+    void beginFrame()
+    {
+        frameCount = allocations;
+        frameBytes = allocatedBytes;
+    }
+
+    void endFrame()
+    {
+        size_t n = allocations - frameCount;
+        frames++;
+        count += n;
+        bytes += allocatedBytes - frameBytes;
+        worst = std::max(worst, n);
+        if (now() - last < 1.0)
+        {
+            return;
+        }
+        cout << "allocations: " << (double)count / frames << " per frame (" << (double)bytes / frames
+             << " bytes), at most " << worst << ", over " << frames << " frames" << endl;
+        frames = count = bytes = worst = 0;
+        last = now();
+    }
+};
+#else
+// without the counter there is nothing to report
+struct AllocationReport
+{
+    void beginFrame() {}
+    void endFrame() {}
+};
+#endif
 
-int main()
+// bench.cc includes this file with GRID_NO_MAIN defined to reuse everything but main
+#ifndef GRID_NO_MAIN
+int main(int argc, char *argv[])
 {
 
+    StartupTimer startup;
+
+    bool loadSnapshot = false;
+    bool perCell = false;
+    bool reportAllocations = false;
+    int heatmap = -1; // a ScalarFormat
+    bool alarms = false;
+    TileStore *store = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        // grid --snapshot FILE starts from (and saves to) a snapshot file
+        if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+        {
+            snapshotPath = argv[++i];
+            loadSnapshot = true;
+        }
+        // grid --per-cell draws every cell as its own quad instead of merging runs
+        else if (strcmp(argv[i], "--per-cell") == 0)
+        {
+            perCell = true;
+        }
+        // grid --allocations prints the heap allocations made per frame, in a
+        // build that counts them
+        else if (strcmp(argv[i], "--allocations") == 0)
+        {
+#ifdef GRID_COUNT_ALLOCATIONS
+            reportAllocations = true;
+#else
+            cout << "ERROR::ALLOCATIONS::NOT_COUNTED\n"
+                 << "build with make grid-allocations to count allocations" << endl;
+#endif
+        }
+        // grid --background R G B sets the color of empty cells, 0 to 1 each
+        else if (strcmp(argv[i], "--background") == 0 && i + 3 < argc)
+        {
+            backgroundColor = vec3(atof(argv[i + 1]), atof(argv[i + 2]), atof(argv[i + 3]));
+            i += 3;
+        }
+        // grid --size WIDTH HEIGHT sets the size of an in-memory grid
+        else if (strcmp(argv[i], "--size") == 0 && i + 2 < argc && atoi(argv[i + 1]) > 0 && atoi(argv[i + 2]) > 0)
+        {
+            GRID_WIDTH = atoi(argv[i + 1]);
+            GRID_HEIGHT = atoi(argv[i + 2]);
+            i += 2;
+        }
+        // grid --heatmap float|uint16 shows a demo scalar field over the cells
+        else if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "float") == 0 || strcmp(argv[i + 1], "uint16") == 0))
+        {
+            heatmap = strcmp(argv[++i], "float") == 0 ? SCALAR_FLOAT : SCALAR_UINT16;
+        }
+        // grid --alarms shows demo cells blinking and pulsing
+        else if (strcmp(argv[i], "--alarms") == 0)
+        {
+            alarms = true;
+        }
+        // grid --no-scene-cache draws every frame from scratch
+        else if (strcmp(argv[i], "--no-scene-cache") == 0)
+        {
+            useSceneCache = false;
+        }
+        // grid --on-demand redraws only when something changes, for grids left on display
+        else if (strcmp(argv[i], "--on-demand") == 0)
+        {
+            onDemand = true;
+        }
+        // grid --frame-budget MS sets the frame time that cell updates must fit in
+        else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc)
+        {
+            frameBudget = atof(argv[++i]) / 1000.0;
+        }
+        // grid --tiles FILE [WIDTH HEIGHT] streams the grid from a tile file,
+        // creating an empty WIDTH x HEIGHT one if it does not exist
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc)
+        {
+            const char *path = argv[++i];
+            unsigned int width = 0, height = 0;
+            if (i + 2 < argc && isdigit(argv[i + 1][0]) && isdigit(argv[i + 2][0]))
+            {
+                width = strtoul(argv[i + 1], NULL, 10);
+                height = strtoul(argv[i + 2], NULL, 10);
+                i += 2;
+            }
+            store = new TileStore();
+            if (!store->open(path, width, height))
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            cout << "ERROR::ARGUMENTS::UNKNOWN\n"
+                 << argv[i] << endl;
+            return -1;
+        }
+    }
+
     glfwInit();
+    startup.mark("GLFW");
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
@@ -555,9 +4614,12 @@ int main()
         return -1;
     }
     glfwMakeContextCurrent(window);
+    startup.mark("window");
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetMouseButtonCallback(window, mouse_button_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
 
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
@@ -565,32 +4627,68 @@ int main()
         return -1;
     }
 
-    grid = new Grid();
-    for (int i = 0; i < GRID_WIDTH; i++)
-    {
-        for (int j = 0; j < GRID_HEIGHT; j++)
-        {
-            // when setting up grid have updateImmediately=false
-            // and batch update once at the end
-            grid->addCell(vec2(i, j), vec3(1, 0, 0), false);
-        }
-    }
-    // batch update
-    grid->cells.update();
+    startup.mark("GL loader");
+
+    grid = new Grid(store);
+    grid->cells.mergeRuns = !perCell;
+    startup.mark("grid");
 
     // point camera at center of the grid, 15 units back from the grid
-    cameraPos = vec3(GRID_WIDTH / 2, GRID_HEIGHT / 2, 15.0f);
+    cameraPos = vec3(grid->width / 2, grid->height / 2, 15.0f);
 
     projection = perspective(radians(fov), ar, nearDist, farDist);
-    glClearColor(1.0, 1.0, 1.0, 1.0);
+    glClearColor(backgroundColor.x, backgroundColor.y, backgroundColor.z, 1.0);
 
     // set camera
     view = lookAt(cameraPos, cameraPos + cameraFront, vec3(0, 1, 0));
-    grid->cells.setCamera(projection * view);
-    grid->lines.setCamera(projection * view);
+    grid->camera.set(projection * view);
+    grid->cells.calculateFrustum();
+
+    if (loadSnapshot)
+    {
+        grid->loadSnapshot(snapshotPath);
+    }
+    else if (!store)
+    {
+        grid->cells.fill(vec3(1, 0, 0));
+        startup.mark("cells");
+        // only the rows in view are sent to the GPU
+        grid->cells.update();
+    }
+    startup.mark("first upload");
+
+    if (heatmap >= 0 && grid->enableScalars((ScalarFormat)heatmap))
+    {
+        // a smooth field from 0 to 1000, empty near the center
+        grid->scalars->fill([](int x, int y)
+                            {
+                                vec2 d = vec2(x, y) - vec2(GRID_WIDTH, GRID_HEIGHT) * 0.5f;
+                                if (dot(d, d) < 50.0f * 50.0f)
+                                {
+                                    return (float)NAN;
+                                }
+                                return 500.0f + 250.0f * (std::sin(x * 0.02f) + std::cos(y * 0.03f)); });
+        grid->scalars->setRange(0, 1000);
+    }
 
+    if (alarms && grid->enableStates())
+    {
+        // state 1 blinks red and yellow, state 2 pulses orange
+        grid->states->setStyle(1, StateStyle{vec4(1, 0, 0, 0.9f), vec4(1, 1, 0, 0.9f), STATE_BLINK, 1.0f});
+        grid->states->setStyle(2, StateStyle{vec4(1, 0.5f, 0, 0.8f), vec4(1, 0.5f, 0, 0.1f), STATE_PULSE, 2.0f});
+        // a scattering of cells in each
+        for (unsigned int i = 0; i < 5000; i++)
+        {
+            unsigned int x = (i * 7919u) % grid->width, y = (i * 104729u) % grid->height;
+            grid->setState(vec2(x, y), i % 4 == 0 ? 1 : 2);
+        }
+    }
+
+    double drawSeconds = 0;
+    AllocationReport allocationReport;
     while (!glfwWindowShouldClose(window))
     {
+        allocationReport.beginFrame();
 
         // float currentFrame = glfwGetTime();
         // deltaTime = currentFrame - lastFrame;
@@ -598,13 +4696,49 @@ int main()
 
         // std::cout << "FPS: " << 1.0/(0.00000001+deltaTime) << std::endl;
         processInput(window);
+        grid->updates.run(drawSeconds);
 
-        glClear(GL_COLOR_BUFFER_BIT);
+        bool redraw = !onDemand || redrawRequested.exchange(false) || grid->animating();
+        if (redraw)
+        {
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
 
-        grid->draw();
+        double drawStart = now();
+        if (redraw)
+        {
+            grid->draw();
+        }
+        if (!grid->tiles)
+        {
+            grid->cells.compressColdRows();
+        }
+        drawSeconds = now() - drawStart;
+
+        if (redraw)
+        {
+            glfwSwapBuffers(window);
+            if (!startup.reported)
+            {
+                startup.mark("first frame");
+                startup.report();
+            }
+        }
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        // on demand, sleep until input or a requestRedraw(), waking in time
+        // for a deferred update to start
+        if (!onDemand || redrawRequested || grid->animating())
+        {
+            glfwPollEvents();
+        }
+        else
+        {
+            glfwWaitEventsTimeout(grid->updates.pending() ? UPDATE_SETTLE_SECONDS : ON_DEMAND_IDLE_SECONDS);
+        }
+        if (reportAllocations)
+        {
+            allocationReport.endFrame();
+        }
     }
 
     glfwTerminate();
@@ -613,6 +4747,7 @@ int main()
 
     return 0;
 }
+#endif
 
 void processInput(GLFWwindow *window)
 {
@@ -659,6 +4794,97 @@ void processInput(GLFWwindow *window)
         selectedColor = vec3(1, 1, 0);
 }
 
+void key_callback(GLFWwindow *, int key, int, int action, int mods)
+{
+    if (action != GLFW_PRESS)
+    {
+        return;
+    }
+    if (key == GLFW_KEY_F5)
+    {
+        grid->saveSnapshot(snapshotPath);
+    }
+    if (key == GLFW_KEY_F9)
+    {
+        grid->loadSnapshot(snapshotPath);
+        grid->journal.clear();
+    }
+    if (key == GLFW_KEY_Z && (mods & GLFW_MOD_CONTROL))
+    {
+        if (mods & GLFW_MOD_SHIFT)
+        {
+            grid->redo();
+        }
+        else
+        {
+            grid->undo();
+        }
+    }
+    if (key == GLFW_KEY_Y && (mods & GLFW_MOD_CONTROL))
+    {
+        grid->redo();
+    }
+    // fill the visible part of the grid with the selected color
+    if (key == GLFW_KEY_F && !(mods & GLFW_MOD_CONTROL))
+    {
+        grid->fill(grid->cells.bottomLeft, grid->cells.topRight, selectedColor);
+    }
+    // Q cycles the demo queries: highlight the top half of the heatmap
+    // range, dim everything outside it, dim every cell not in state 1, off
+    if (key == GLFW_KEY_Q)
+    {
+        static int demoQuery = 0;
+        CellQuery q;
+        bool asked = false;
+        for (int tries = 0; tries < 4 && !asked; tries++)
+        {
+            demoQuery = (demoQuery + 1) % 4;
+            if (demoQuery == 0)
+            {
+                grid->clearQuery();
+                asked = true;
+            }
+            else if (demoQuery < 3 && grid->scalars)
+            {
+                q.testValue = true;
+                q.valueMin = (grid->scalars->valueMin + grid->scalars->valueMax) * 0.5f;
+                q.valueMax = INFINITY;
+                asked = demoQuery == 1 ? grid->setQuery(q, QUERY_HIGHLIGHT, vec4(1, 1, 1, 0.6f))
+                                       : grid->setQuery(q, QUERY_DIM, vec4(backgroundColor, 0.85f));
+            }
+            else if (demoQuery == 3 && grid->states)
+            {
+                q.testState = true;
+                q.state = 1;
+                asked = grid->setQuery(q, QUERY_DIM, vec4(backgroundColor, 0.85f));
+            }
+        }
+    }
+    // heatmap: C cycles the colormap, L toggles the log scale, [ and ] halve
+    // and double the top of the range
+    if (grid->scalars)
+    {
+        ScalarField &scalars = *grid->scalars;
+        if (key == GLFW_KEY_C)
+        {
+            scalars.setColormap((Colormap)((scalars.colormap + 1) % COLORMAP_COUNT));
+        }
+        if (key == GLFW_KEY_L)
+        {
+            scalars.setLogScale(!scalars.logScale);
+        }
+        if (key == GLFW_KEY_LEFT_BRACKET)
+        {
+            scalars.setRange(scalars.valueMin, scalars.valueMin + (scalars.valueMax - scalars.valueMin) * 0.5f);
+        }
+        if (key == GLFW_KEY_RIGHT_BRACKET)
+        {
+            scalars.setRange(scalars.valueMin, scalars.valueMin + (scalars.valueMax - scalars.valueMin) * 2.0f);
+        }
+        requestRedraw();
+    }
+}
+
 void mouse_callback(GLFWwindow *window, double xpos, double ypos)
 {
 
@@ -675,16 +4901,6 @@ void mouse_callback(GLFWwindow *window, double xpos, double ypos)
     lastX = xpos;
     lastY = ypos;
 
-    // switch to update less frequently when many squares on the screen
-    if (cameraPos.z > 15.0f)
-    {
-        realTimeUpdating = false;
-    }
-    else
-    {
-        realTimeUpdating = true;
-    }
-
     // scrolling moves camera closer and further from the grid
     int state = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_MIDDLE);
     if (state == GLFW_PRESS)
@@ -693,14 +4909,9 @@ void mouse_callback(GLFWwindow *window, double xpos, double ypos)
         cameraPos -= scrollSpeed * vec3(xoffset / (float)SCR_WIDTH, yoffset / (float)SCR_WIDTH, 0);
         // update camera
         view = lookAt(cameraPos, cameraPos + cameraFront, vec3(0, 1, 0));
-        grid->cells.setCamera(projection * view);
-        grid->lines.setCamera(projection * view);
+        grid->camera.set(projection * view);
         grid->cells.calculateFrustum();
-
-        if (realTimeUpdating)
-        {
-            grid->cells.update();
-        }
+        grid->viewChanged();
     }
     else
     {
@@ -709,21 +4920,22 @@ void mouse_callback(GLFWwindow *window, double xpos, double ypos)
     }
 }
 
-void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
+void scroll_callback(GLFWwindow *, double, double yoffset)
 {
     scrollSpeed = cameraPos.z * 0.1;
     cameraPos += (float)yoffset * scrollSpeed * rayCast(lastX, lastY, projection, view);
     // update camera
     view = lookAt(cameraPos, cameraPos + cameraFront, vec3(0, 1, 0));
-    grid->cells.setCamera(projection * view);
-    grid->lines.setCamera(projection * view);
+    grid->camera.set(projection * view);
     grid->cells.calculateFrustum();
-    grid->cells.update();
+    grid->viewChanged();
 }
 
-void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
+void mouse_button_callback(GLFWwindow *, int button, int action, int)
 {
 
+    bool wasEditing = leftMouseButtonPressed || rightMouseButtonPressed;
+
     if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
     {
         leftMouseButtonPressed = true;
@@ -742,11 +4954,20 @@ void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
         rightMouseButtonPressed = false;
     }
 
-    if (button == GLFW_MOUSE_BUTTON_MIDDLE && action == GLFW_RELEASE)
+    // a stroke, from pressing a button until none is held, is one undoable operation
+    bool editing = leftMouseButtonPressed || rightMouseButtonPressed;
+    if (editing && !wasEditing)
     {
-        if (!realTimeUpdating)
-        {
-            grid->cells.update();
-        }
+        grid->journal.begin();
+    }
+    else if (!editing && wasEditing)
+    {
+        grid->journal.end();
     }
 }
+
+// the window was exposed or resized and must be drawn again
+void refresh_callback(GLFWwindow *)
+{
+    requestRedraw();
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
@@ -12,11 +13,11 @@ typedef struct vec2
     float y;
 } vec2;
 
-vec2 *vec2_init(float _x, float _y)
+vec2 vec2_init(float _x, float _y)
 {
-    vec2 *v = (vec2 *)malloc(sizeof(vec2));
-    v->x = _x;
-    v->y = _y;
+    vec2 v;
+    v.x = _x;
+    v.y = _y;
     return v;
 }
 
@@ -27,65 +28,66 @@ typedef struct vec3
     float z;
 } vec3;
 
-vec3 *vec3_init(float _x, float _y, float _z)
+vec3 vec3_init(float _x, float _y, float _z)
 {
-    vec3 *v = (vec3 *)malloc(sizeof(vec3));
-    v->x = _x;
-    v->y = _y;
-    v->z = _z;
+    vec3 v;
+    v.x = _x;
+    v.y = _y;
+    v.z = _z;
     return v;
 }
 
-typedef struct line
-{
-    int shaderProgram;
-    unsigned int VBO, VAO;
-    float *vertices;
-    vec2 *startPoint;
-    vec2 *endPoint;
-    vec3 *lineColor;
-} line;
+// every line shares one program, compiled on first use. Each line is an
+// instance of a quad that the vertex shader stretches between the two end
+// points and widens to the line's width in pixels; the fragment shader fades
+// the outermost pixel for anti-aliasing.
+static int lineProgram = 0;
+static int lineViewportLocation = -1;
 
-line *line_init(vec2 *start, vec2 *end)
+int line_program()
 {
-
-    line *l = (line *)malloc(sizeof(line));
-
-    float x1 = start->x;
-    float y1 = start->y;
-    float x2 = end->x;
-    float y2 = end->y;
-    float w = SCR_WIDTH;
-    float h = SCR_HEIGHT;
-
-    // convert 3d world space position 2d screen space position
-    x1 = 2 * x1 / w - 1;
-    y1 = 2 * y1 / h - 1;
-
-    x2 = 2 * x2 / w - 1;
-    y2 = 2 * y2 / h - 1;
-
-    start->x = x1;
-    start->y = y1;
-    end->x = x2;
-    end->y = y2;
-
-    l->startPoint = start;
-    l->endPoint = end;
-    l->lineColor = vec3_init(1.0f, 1.0f, 1.0f);
+    if (lineProgram)
+    {
+        return lineProgram;
+    }
 
     const char *vertexShaderSource = "#version 330 core\n"
-                                     "layout (location = 0) in vec3 aPos;\n"
+                                     "layout (location = 0) in vec2 aCorner; // along 0..1, across -1..1\n"
+                                     "layout (location = 1) in float aStartX;\n"
+                                     "layout (location = 2) in float aStartY;\n"
+                                     "layout (location = 3) in float aEndX;\n"
+                                     "layout (location = 4) in float aEndY;\n"
+                                     "layout (location = 5) in float aRed;\n"
+                                     "layout (location = 6) in float aGreen;\n"
+                                     "layout (location = 7) in float aBlue;\n"
+                                     "layout (location = 8) in float aWidth;\n"
+                                     "uniform vec2 viewport;\n"
+                                     "out vec3 color;\n"
+                                     "out float across;\n"
+                                     "out float halfWidth;\n"
                                      "void main()\n"
                                      "{\n"
-                                     "   gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
+                                     "   vec2 start = vec2(aStartX, aStartY);\n"
+                                     "   vec2 end = vec2(aEndX, aEndY);\n"
+                                     "   vec2 halfViewport = viewport * 0.5;\n"
+                                     "   vec2 direction = (end - start) * halfViewport;\n"
+                                     "   direction = length(direction) > 0.0 ? normalize(direction) : vec2(1.0, 0.0);\n"
+                                     "   vec2 normal = vec2(-direction.y, direction.x);\n"
+                                     "   halfWidth = aWidth * 0.5;\n"
+                                     "   across = aCorner.y * (halfWidth + 1.0);\n"
+                                     "   vec2 offset = normal * across + direction * (aCorner.x * 2.0 - 1.0) * halfWidth;\n"
+                                     "   gl_Position = vec4(mix(start, end, aCorner.x) + offset / halfViewport, 0.0, 1.0);\n"
+                                     "   color = vec3(aRed, aGreen, aBlue);\n"
                                      "}\0";
     const char *fragmentShaderSource = "#version 330 core\n"
                                        "out vec4 FragColor;\n"
-                                       "uniform vec3 color;\n"
+                                       "in vec3 color;\n"
+                                       "in float across;\n"
+                                       "in float halfWidth;\n"
                                        "void main()\n"
                                        "{\n"
-                                       "   FragColor = vec4(color, 1.0f);\n"
+                                       "   float coverage = clamp(halfWidth + 0.5 - abs(across), 0.0, 1.0);\n"
+                                       "   FragColor = vec4(color, coverage);\n"
                                        "}\n\0";
 
     // vertex shader
@@ -99,50 +101,298 @@ line *line_init(vec2 *start, vec2 *end)
     glCompileShader(fragmentShader);
 
     // link shaders
-    l->shaderProgram = glCreateProgram();
-    glAttachShader(l->shaderProgram, vertexShader);
-    glAttachShader(l->shaderProgram, fragmentShader);
-    glLinkProgram(l->shaderProgram);
+    lineProgram = glCreateProgram();
+    glAttachShader(lineProgram, vertexShader);
+    glAttachShader(lineProgram, fragmentShader);
+    glLinkProgram(lineProgram);
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
 
-    // setting vertex data
-    l->vertices = (float *)(malloc(sizeof(float) * 6));
-    l->vertices[0] = start->x;
-    l->vertices[1] = start->y;
-    l->vertices[2] = end->x;
-    l->vertices[3] = end->y;
+    lineViewportLocation = glGetUniformLocation(lineProgram, "viewport");
+    return lineProgram;
+}
+
+// line geometry as a structure of arrays: every line's start x in one array,
+// every start y in the next and so on, all carved out of a single block.
+// Resetting is O(1) and keeps the block, so rebuilding a scene of the same
+// size allocates nothing; line_arena_free releases everything at once.
+#define LINE_ARRAYS 8
 
-    glGenVertexArrays(1, &l->VAO);
-    glGenBuffers(1, &l->VBO);
-    glBindVertexArray(l->VAO);
+typedef struct line_arena
+{
+    float *block;
+    float *startX, *startY, *endX, *endY;
+    float *red, *green, *blue;
+    float *width; // pixels
+    size_t count;
+    size_t capacity;
+} line_arena;
+
+// the arrays in block order, which is also their attribute order
+void line_arena_arrays(line_arena *a, float **arrays[LINE_ARRAYS])
+{
+    arrays[0] = &a->startX;
+    arrays[1] = &a->startY;
+    arrays[2] = &a->endX;
+    arrays[3] = &a->endY;
+    arrays[4] = &a->red;
+    arrays[5] = &a->green;
+    arrays[6] = &a->blue;
+    arrays[7] = &a->width;
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, l->VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(l->vertices) * 4,
-                 &l->vertices[0],
-                 GL_STATIC_DRAW);
+void line_arena_init(line_arena *a)
+{
+    memset(a, 0, sizeof(*a));
+}
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
-                          2 * sizeof(float), (void *)0);
+void line_arena_reserve(line_arena *a, size_t n)
+{
+    if (a->count + n <= a->capacity)
+    {
+        return;
+    }
+    size_t capacity = a->capacity ? a->capacity : 64;
+    while (capacity < a->count + n)
+    {
+        capacity *= 2;
+    }
+
+    float *block = (float *)malloc(LINE_ARRAYS * capacity * sizeof(float));
+    float **arrays[LINE_ARRAYS];
+    line_arena_arrays(a, arrays);
+    for (int i = 0; i < LINE_ARRAYS; i++)
+    {
+        float *array = block + i * capacity;
+        if (a->count)
+        {
+            memcpy(array, *arrays[i], a->count * sizeof(float));
+        }
+        *arrays[i] = array;
+    }
+    free(a->block);
+    a->block = block;
+    a->capacity = capacity;
+}
+
+size_t line_arena_add(line_arena *a, vec2 start, vec2 end, vec3 color, float width)
+{
+    line_arena_reserve(a, 1);
+    size_t i = a->count++;
+    a->startX[i] = start.x;
+    a->startY[i] = start.y;
+    a->endX[i] = end.x;
+    a->endY[i] = end.y;
+    a->red[i] = color.x;
+    a->green[i] = color.y;
+    a->blue[i] = color.z;
+    a->width[i] = width;
+    return i;
+}
+
+void line_arena_reset(line_arena *a)
+{
+    a->count = 0;
+}
+
+void line_arena_free(line_arena *a)
+{
+    free(a->block);
+    line_arena_init(a);
+}
+
+// all lines are drawn with a single instanced call. The vertex buffer holds
+// the arena's arrays as they are, one attribute stream per array.
+typedef struct line_batch
+{
+    line_arena geometry;
+    unsigned int cornerVBO, VBO, VAO;
+    size_t uploaded; // lines the VBO has room for
+    // lines [dirtyBegin, dirtyEnd) changed since the last upload
+    size_t dirtyBegin, dirtyEnd;
+} line_batch;
+
+line_batch lines;
+
+// a line is its index in the batch
+typedef struct line
+{
+    size_t index;
+} line;
+
+void line_batch_init(line_batch *b)
+{
+    float corners[] = {
+        0.0f, -1.0f,
+        0.0f, 1.0f,
+        1.0f, -1.0f,
+        1.0f, 1.0f};
+
+    line_arena_init(&b->geometry);
+    b->uploaded = 0;
+    b->dirtyBegin = 0;
+    b->dirtyEnd = 0;
+
+    glGenVertexArrays(1, &b->VAO);
+    glGenBuffers(1, &b->cornerVBO);
+    glGenBuffers(1, &b->VBO);
+    glBindVertexArray(b->VAO);
+
+    glBindBuffer(GL_ARRAY_BUFFER, b->cornerVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *)0);
     glEnableVertexAttribArray(0);
 
+    for (int i = 0; i < LINE_ARRAYS; i++)
+    {
+        glEnableVertexAttribArray(1 + i);
+        glVertexAttribDivisor(1 + i, 1);
+    }
+
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+}
+
+void line_batch_touch(line_batch *b, size_t index)
+{
+    if (b->dirtyBegin == b->dirtyEnd)
+    {
+        b->dirtyBegin = index;
+        b->dirtyEnd = index + 1;
+    }
+    else
+    {
+        b->dirtyBegin = index < b->dirtyBegin ? index : b->dirtyBegin;
+        b->dirtyEnd = index + 1 > b->dirtyEnd ? index + 1 : b->dirtyEnd;
+    }
+}
+
+// drop every line but keep all memory for the next scene
+void line_batch_reset(line_batch *b)
+{
+    line_arena_reset(&b->geometry);
+    b->dirtyBegin = b->dirtyEnd = 0;
+}
+
+void line_batch_free(line_batch *b)
+{
+    line_arena_free(&b->geometry);
+    glDeleteBuffers(1, &b->cornerVBO);
+    glDeleteBuffers(1, &b->VBO);
+    glDeleteVertexArrays(1, &b->VAO);
+}
+
+// send the changed lines to the GPU, at most once per frame
+void line_batch_upload(line_batch *b)
+{
+    line_arena *a = &b->geometry;
+    if (b->dirtyBegin == b->dirtyEnd)
+    {
+        return;
+    }
+
+    glBindVertexArray(b->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, b->VBO);
+    if (a->count > b->uploaded)
+    {
+        // grow the buffer to the whole capacity so that adding lines
+        // usually only needs sub-range updates
+        b->uploaded = a->capacity;
+        glBufferData(GL_ARRAY_BUFFER, LINE_ARRAYS * b->uploaded * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+        for (int i = 0; i < LINE_ARRAYS; i++)
+        {
+            glVertexAttribPointer(1 + i, 1, GL_FLOAT, GL_FALSE, sizeof(float),
+                                  (void *)(i * b->uploaded * sizeof(float)));
+        }
+        b->dirtyBegin = 0;
+    }
+
+    float **arrays[LINE_ARRAYS];
+    line_arena_arrays(a, arrays);
+    for (int i = 0; i < LINE_ARRAYS; i++)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, (i * b->uploaded + b->dirtyBegin) * sizeof(float),
+                        (b->dirtyEnd - b->dirtyBegin) * sizeof(float),
+                        *arrays[i] + b->dirtyBegin);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    b->dirtyBegin = b->dirtyEnd = 0;
+}
 
+void line_batch_draw(line_batch *b, int width, int height)
+{
+    line_batch_upload(b);
+
+    glUseProgram(line_program());
+    glUniform2f(lineViewportLocation, width, height);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    glBindVertexArray(b->VAO);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, b->geometry.count);
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+}
+
+line line_init(vec2 start, vec2 end)
+{
+
+    float x1 = start.x;
+    float y1 = start.y;
+    float x2 = end.x;
+    float y2 = end.y;
+    float w = SCR_WIDTH;
+    float h = SCR_HEIGHT;
+
+    // convert 3d world space position 2d screen space position
+    x1 = 2 * x1 / w - 1;
+    y1 = 2 * y1 / h - 1;
+
+    x2 = 2 * x2 / w - 1;
+    y2 = 2 * y2 / h - 1;
+
+    line l;
+    l.index = line_arena_add(&lines.geometry, vec2_init(x1, y1), vec2_init(x2, y2), vec3_init(1.0f, 1.0f, 1.0f), 1.0f);
+    line_batch_touch(&lines, l.index);
     return l;
 }
 
-int line_draw(line *l)
+void line_set_color(line l, float r, float g, float b)
 {
+    lines.geometry.red[l.index] = r;
+    lines.geometry.green[l.index] = g;
+    lines.geometry.blue[l.index] = b;
+    line_batch_touch(&lines, l.index);
+}
 
-    glUseProgram(l->shaderProgram);
-    glUniform3fv(glGetUniformLocation(l->shaderProgram, "color"),
-                 1, &l->lineColor->x);
+void line_set_width(line l, float width)
+{
+    lines.geometry.width[l.index] = width;
+    line_batch_touch(&lines, l.index);
+}
 
-    glBindVertexArray(l->VAO);
-    glDrawArrays(GL_LINES, 0, 2);
-    return 0;
+// the six example lines, plus n random ones
+void build_scene(size_t n)
+{
+    line_batch_reset(&lines);
+
+    line_init(vec2_init(100, 100), vec2_init(100, 200));
+    line_init(vec2_init(200, 100), vec2_init(400, 150));
+    line_init(vec2_init(400, 600), vec2_init(600, 400));
+    line_init(vec2_init(300, 300), vec2_init(500, 100));
+    line_set_width(line_init(vec2_init(600, 50), vec2_init(400, 100)), 4.0f);
+    line_set_width(line_init(vec2_init(400, 400), vec2_init(800, 600)), 8.0f);
+
+    line_arena_reserve(&lines.geometry, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        line l = line_init(vec2_init(rand() % SCR_WIDTH, rand() % SCR_HEIGHT),
+                           vec2_init(rand() % SCR_WIDTH, rand() % SCR_HEIGHT));
+        line_set_color(l, rand() / (float)RAND_MAX, rand() / (float)RAND_MAX, rand() / (float)RAND_MAX);
+        line_set_width(l, 1.0f + rand() % 4);
+    }
 }
 
 int main(int argc, char *argv[])
@@ -154,7 +404,8 @@ int main(int argc, char *argv[])
     }
 
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    // the shaders are GLSL 3.30 and instancing needs glVertexAttribDivisor
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 
@@ -168,33 +419,33 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    line *line1 = line_init(vec2_init(100, 100), vec2_init(100, 200));
-    line *line2 = line_init(vec2_init(200, 100), vec2_init(400, 150));
-    line *line3 = line_init(vec2_init(400, 600), vec2_init(600, 400));
-    line *line4 = line_init(vec2_init(300, 300), vec2_init(500, 100));
-    line *line5 = line_init(vec2_init(600, 50), vec2_init(400, 100));
-    line *line6 = line_init(vec2_init(400, 400), vec2_init(800, 600));
+    line_batch_init(&lines);
+
+    // lines N adds N random lines, e.g. to try a million
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+    build_scene(n);
 
     while (!glfwWindowShouldClose(window))
     {
 
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
             glfwSetWindowShouldClose(window, 1);
+        // R rebuilds the scene in place, reusing all of its memory
+        if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS)
+            build_scene(n);
 
         glClearColor(0.0, 0.0, 0.0, 1.0);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        line_draw(line1);
-        line_draw(line2);
-        line_draw(line3);
-        line_draw(line4);
-        line_draw(line5);
-        line_draw(line6);
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        line_batch_draw(&lines, width, height);
 
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
+    line_batch_free(&lines);
     glfwTerminate();
     return EXIT_SUCCESS;
 }